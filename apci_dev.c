@@ -21,6 +21,9 @@
 #include <linux/idr.h>
 #include <linux/version.h>
 #include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 
 #include "apci_common.h"
 #include "apci_dev.h"
@@ -38,6 +41,20 @@
 #define bmADIO_DMADoneEnable (1 << 2)
 #define bmADIO_ADCTRIGGERStatus (1 << 16)
 #define bmADIO_ADCTRIGGEREnable (1 << 0)
+#define mPCIe_ADIO_BaseClockOffset (0x0C)
+#define mPCIe_ADIO_DivisorOffset (0x10)
+#define mPCIe_ADIO_FAFThresholdOffset (0x20)
+#define mPCIe_ADIO_FIFOLevelOffset (0x28)
+#define mPCIe_ADIO_FAFMax (0xFFF)
+#define mPCIe_ADIO_FIFOEntryBytes (8)
+
+static enum hrtimer_restart apci_poll_timer_fn(struct hrtimer *timer);
+static enum hrtimer_restart apci_coalesce_timer_fn(struct hrtimer *timer);
+static enum hrtimer_restart apci_debounce_timer_fn(struct hrtimer *timer);
+static enum hrtimer_restart apci_quad_timer_fn(struct hrtimer *timer);
+static enum hrtimer_restart apci_dma_flush_timer_fn(struct hrtimer *timer);
+static void apci_level_work_fn(struct work_struct *work);
+static void apci_dma_rewind_locked(struct apci_my_info *ddata);
 
 /* PCI table construction */
 static struct pci_device_id ids[] = {
@@ -660,10 +677,30 @@ static struct pci_driver pci_driver = {
     .remove = remove,
 };
 
+/* Bytes of coherent DMA memory to set aside per DMA-capable card at probe,
+ * so acquisition can be set up and restarted without allocating.
+ */
+static unsigned int dma_prealloc_kb = 0;
+module_param(dma_prealloc_kb, uint, 0444);
+MODULE_PARM_DESC(dma_prealloc_kb, "DMA ring (KiB) to preallocate per DMA-capable card at probe, 0 to allocate on demand");
+
 /* File Operations */
 static struct file_operations apci_fops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+    .read_iter = read_iter_apci,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+#else
     .read = read_apci,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+    .poll = poll_apci,
+#endif
     .open = open_apci,
+    .release = release_apci,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 39)
     .ioctl = ioctl_apci,
 #else
@@ -690,13 +727,22 @@ void *
 apci_alloc_driver(struct pci_dev *pdev, const struct pci_device_id *id)
 {
 
-  struct apci_my_info *ddata = kmalloc(sizeof(struct apci_my_info), GFP_KERNEL);
+  struct apci_my_info *ddata = kzalloc(sizeof(struct apci_my_info), GFP_KERNEL);
   int count, plx_bar;
   struct resource *presource;
 
   if (!ddata)
     return NULL;
 
+  ddata->status_page = (status_page_t *)get_zeroed_page(GFP_KERNEL);
+  if (!ddata->status_page)
+    goto out_alloc_driver;
+  spin_lock_init(&(ddata->status_lock));
+  ddata->ring_ctl = (dma_ring_ctl_t *)get_zeroed_page(GFP_KERNEL);
+  if (!ddata->ring_ctl)
+    goto out_alloc_driver;
+  ddata->ring_ctl->index_wrap = 1;
+
   ddata->dac_fifo_buffer = NULL;
 
   /* Initialize with defaults, fill in specifics later */
@@ -721,7 +767,40 @@ apci_alloc_driver(struct pci_dev *pdev, const struct pci_device_id *id)
 
   ddata->dev_id = id->device;
 
+  switch (ddata->dev_id)
+  {
+  case PCIe_IDIO_12:
+  case PCIe_IDIO_24:
+    ddata->edge_counters = (edge_counters_t *)get_zeroed_page(GFP_KERNEL);
+    if (!ddata->edge_counters)
+      goto out_alloc_driver;
+    break;
+  case MPCIE_QUAD_4:
+  case MPCIE_QUAD_8:
+  case PCI_QUAD_4:
+  case PCI_QUAD_8:
+    ddata->quad = (quad_state_t *)get_zeroed_page(GFP_KERNEL);
+    if (!ddata->quad)
+      goto out_alloc_driver;
+    break;
+  }
+
   spin_lock_init(&(ddata->irq_lock));
+  ddata->irq_affinity_cpu = -1;
+  apci_hrtimer_setup(&ddata->poll_timer, apci_poll_timer_fn);
+  apci_hrtimer_setup(&ddata->coalesce_timer, apci_coalesce_timer_fn);
+  apci_hrtimer_setup(&ddata->debounce_timer, apci_debounce_timer_fn);
+  apci_hrtimer_setup(&ddata->quad_timer, apci_quad_timer_fn);
+  apci_hrtimer_setup(&ddata->dma_flush_timer, apci_dma_flush_timer_fn);
+  spin_lock_init(&(ddata->quad_lock));
+  spin_lock_init(&(ddata->dma_data_lock));
+  mutex_init(&ddata->action_lock);
+  mutex_init(&ddata->read_lock);
+  INIT_LIST_HEAD(&ddata->dma_cursors);
+  INIT_WORK(&ddata->level_work, apci_level_work_fn);
+  spin_lock_init(&(ddata->level_lock));
+  ddata->level_above = -1;
+  spin_lock_init(&(ddata->coalesce_lock));
   /* ddata->next = NULL; */
 
   switch (ddata->dev_id)
@@ -1209,9 +1288,16 @@ apci_alloc_driver(struct pci_dev *pdev, const struct pci_device_id *id)
     break;
   }
 
+  if (ddata->edge_counters)
+    ddata->edge_counters->state = inl(ddata->regions[2].start + 0x4);
+
   return ddata;
 
 out_alloc_driver:
+  free_page((unsigned long)ddata->quad);
+  free_page((unsigned long)ddata->edge_counters);
+  free_page((unsigned long)ddata->ring_ctl);
+  free_page((unsigned long)ddata->status_page);
   kfree(ddata);
   return NULL;
 }
@@ -1259,6 +1345,11 @@ void apci_free_driver(struct pci_dev *pdev)
   {
     kfree(ddata->dac_fifo_buffer);
   }
+  free_page((unsigned long)ddata->action_log);
+  free_page((unsigned long)ddata->quad);
+  free_page((unsigned long)ddata->edge_counters);
+  free_page((unsigned long)ddata->ring_ctl);
+  free_page((unsigned long)ddata->status_page);
   kfree(ddata);
   apci_debug("Completed freeing driver.\n");
 }
@@ -1304,15 +1395,11 @@ apci_class_dev_register(struct apci_my_info *ddata)
   return 0;
 }
 
-irqreturn_t apci_interrupt(int irq, void *dev_id)
-{
-  struct apci_my_info *ddata;
-  __u8 byte;
-  __u32 dword;
-  bool notify_user = true;
-  uint32_t irq_event = 0;
+/* Window over which the adaptive IRQ/polling logic measures the event rate */
+#define APCI_RATE_WINDOW_NS (10 * NSEC_PER_MSEC)
 
-  ddata = (struct apci_my_info *)dev_id;
+int apci_is_axio(struct apci_my_info *ddata)
+{
   switch (ddata->dev_id)
   {
   case PCIe_ADIO16_16FDS:
@@ -1354,183 +1441,139 @@ irqreturn_t apci_interrupt(int irq, void *dev_id)
   case mPCIe_ADI12_8A:
   case mPCIe_ADI12_8:
   case mPCIe_ADI12_8E:
-    break;
-
+    return 1;
   default:
-    /* The first thing we do is check to see if the card is causing an IRQ.
-     * If it is then we can proceed to clear the IRQ. Otherwise let
-     * Linux know that it wasn't us.
-     */
-    if (!ddata->is_pcie)
-    {
-      byte = inb(ddata->plx_region.start + 0x4C);
+    return 0;
+  }
+}
 
-      if ((byte & 4) == 0)
-      {
-        return IRQ_NONE; /* not me */
-      }
-    }
-    else
-    { /* PCIe */
-      if (ddata->plx_region.flags & IORESOURCE_IO)
-      {
-        byte = inb(ddata->plx_region.start + 0x69);
-      }
-      else
-      {
-        byte = ioread8(ddata->plx_region.mapped_address + 0x69);
-      }
+/* Wake the thread blocked in apci_wait_for_irq_ioctl, if any, and
+ * anyone waiting for DMA slots.
+ */
+static void apci_wake_waiter(struct apci_my_info *ddata)
+{
+  wake_up_interruptible(&(ddata->dma_wait_queue));
 
-      if ((byte & 0x80) == 0)
-      {
-        return IRQ_NONE; /* not me */
-      }
-    }
-  } // handle 9052 & 8311 "IAm" IRQ Flags
+  spin_lock(&(ddata->irq_lock));
 
-  apci_devel("ISR called.\n");
+  if (ddata->waiting_for_irq)
+  {
+    ddata->waiting_for_irq = 0;
+    spin_unlock(&(ddata->irq_lock));
+    wake_up_interruptible(&(ddata->wait_queue));
+  }
+  else
+  {
+    spin_unlock(&(ddata->irq_lock));
+  }
+}
 
-  /* Handle interrupt based on the device ID for the board. */
-  switch (ddata->dev_id)
+/* Deliver the pending coalesced events with a single wakeup. */
+static void apci_coalesce_flush(struct apci_my_info *ddata)
+{
+  unsigned long flags;
+  __u32 delivered;
+
+  spin_lock_irqsave(&(ddata->coalesce_lock), flags);
+  delivered = ddata->coalesce_pending;
+  ddata->coalesce_pending = 0;
+  if (delivered)
   {
-  case PCIe_DIO_24:
-  case PCIe_DIO_24D:
-  case PCIe_DIO_24S:
-  case PCIe_DIO_24DS:
-  case PCIe_DIO_24DC:
-  case PCIe_DIO_24DCS:
-  case PCIe_DIO_48:
-  case PCIe_DIO_48S:
-  case PCI_DIO_24H:
-  case PCI_DIO_24D:
-  case PCI_DIO_24H_C:
-  case PCI_DIO_24D_C:
-  case PCI_DIO_24S:
-  case PCI_DIO_48:
-  case PCI_DIO_48S:
-  case MPCIE_DIO_24:
-  case MPCIE_DIO_24S:
-  case MPCIE_DIO_24S_R1:
-    outb(0, ddata->regions[2].start + 0x0f);
-    break;
+    ddata->coalesce_stats.events += delivered;
+    ddata->coalesce_stats.wakeups++;
+    if (delivered > ddata->coalesce_stats.max_events_per_wakeup)
+      ddata->coalesce_stats.max_events_per_wakeup = delivered;
+    ddata->coalesce_stats.histogram[min(ilog2(delivered), APCI_COALESCE_BUCKETS - 1)]++;
+  }
+  spin_unlock_irqrestore(&(ddata->coalesce_lock), flags);
 
-    /* These cards don't have the IRQ simply "Cleared",
-     * it must be disabled then re-enabled.
-     */
-  case PCI_DIO_72:
-  case PCI_DIO_96:
-  case PCI_DIO_96CT:
-  case PCI_DIO_96C3:
-  case PCI_DIO_120:
-  case PCIe_DIO_72:
-  case PCIe_DIO_96:
-  case PCIe_DIO_120:
-    outb(0, ddata->regions[2].start + 0x1e);
-    outb(0, ddata->regions[2].start + 0x1f);
-    break;
+  if (delivered)
+    apci_wake_waiter(ddata);
+}
 
-  case PCI_DA12_16:
-  case PCI_DA12_8:
-  case PCIe_DA16_16:
-  case PCIe_DA16_8:
-  case PCIe_DA12_16:
-  case PCIe_DA12_8:
-    byte = inb(ddata->regions[2].start + 0xC);
-    break;
+static enum hrtimer_restart apci_coalesce_timer_fn(struct hrtimer *timer)
+{
+  struct apci_my_info *ddata = container_of(timer, struct apci_my_info, coalesce_timer);
 
-  case PCI_WDG_CSM:
-    outb(0, ddata->regions[2].start + 0x9);
-    outb(0, ddata->regions[2].start + 0x4);
-    break;
+  apci_coalesce_flush(ddata);
+  return HRTIMER_NORESTART;
+}
 
-  case PCIe_IIRO_8:
-  case PCIe_IIRO_16:
-  case PCI_IIRO_8:
-  case PCI_IIRO_16:
-  case PCI_IDIO_16:
-  case LPCI_IIRO_8:
-    apci_devel("Interrupt for PCIe_IIRO_8");
-    outb(0, ddata->regions[2].start + 0x1);
-    break;
+/* Queue an event for the user, waking them now or once the coalescing
+ * limits are reached. IRQ context.
+ */
+static void apci_notify(struct apci_my_info *ddata)
+{
+  bool flush;
 
-  case PCI_IDI_48:
-    byte = inb(ddata->regions[2].start + 0x7);
-    break;
+  spin_lock(&(ddata->coalesce_lock));
+  ddata->coalesce_pending++;
+  if (ddata->coalesce_ns == 0)
+  {
+    flush = (ddata->coalesce_frames <= 1 || ddata->coalesce_pending >= ddata->coalesce_frames);
+  }
+  else
+  {
+    flush = (ddata->coalesce_frames && ddata->coalesce_pending >= ddata->coalesce_frames);
+    if (!flush && ddata->coalesce_pending == 1)
+      hrtimer_start(&ddata->coalesce_timer, ns_to_ktime(ddata->coalesce_ns), HRTIMER_MODE_REL);
+  }
+  spin_unlock(&(ddata->coalesce_lock));
 
-  case PCI_AI12_16:
-  case PCI_AI12_16_:
-  case PCI_AI12_16A:
-  case PCI_AIO12_16:
-  case PCI_A12_16A:
-    /* Clear the FIFO interrupt enable bits, but leave
-     * the counter enabled.  Otherwise the IRQ will not
-     * go away and user code will never run as the machine
-     * will hang in a never-ending IRQ loop. The userland
-     * irq routine must re-enable the interrupts if desired.
-     */
-    outb(0x01, ddata->regions[2].start + 0x4);
-    byte = inb(ddata->regions[2].start + 0x4);
-    break;
+  if (flush)
+  {
+    hrtimer_try_to_cancel(&ddata->coalesce_timer);
+    apci_coalesce_flush(ddata);
+  }
+}
 
-  case LPCI_A16_16A:
-    outb(0, ddata->regions[2].start + 0xc);
-    outb(0x10, ddata->regions[2].start + 0xc);
-    break;
+/* Change the coalescing limits, delivering anything already pending.
+ * Process context only.
+ */
+void apci_set_coalescing(struct apci_my_info *ddata, __u32 frames, __u32 usecs)
+{
+  unsigned long flags;
 
-  case P104_DIO_96:  /* unknown at this time 6-FEB-2007 */
-  case P104_DIO_48S: /* unknown at this time 6-FEB-2007 */
-    break;
-  case MPCIE_IDIO_8:
-  case MPCIE_IIRO_8:
-  case MPCIE_IDIO_4:
-  case MPCIE_IIRO_4:
-  case MPCIE_IDO_8:
-  case MPCIE_RO_8:
-  case MPCIE_II_16:
-  case MPCIE_II_8:
-  case MPCIE_II_4:
-    outb(0xff, ddata->regions[2].start + 41);
-    break;
+  spin_lock_irqsave(&(ddata->coalesce_lock), flags);
+  ddata->coalesce_frames = frames;
+  ddata->coalesce_ns = (u64)usecs * NSEC_PER_USEC;
+  spin_unlock_irqrestore(&(ddata->coalesce_lock), flags);
 
-  case MPCIE_QUAD_4:
-  case PCI_QUAD_4:
-    {
-      int i;
-      for (i = 0; i < 4; i++)
-      {
-        byte = inb(ddata->regions[2].start + 0x8 * i + 7);
-        if (0 ==( byte & 0x80))
-          break;
+  hrtimer_cancel(&ddata->coalesce_timer);
+  apci_coalesce_flush(ddata);
+}
 
-        if (byte & 0x08)
-          outb(0x08, ddata->regions[2].start + 0x8 * i + 6);
-      }
-    }
-    break;
+/* Bus address of a ring slot. */
+static dma_addr_t apci_dma_slot_addr(struct apci_my_info *ddata, int slot)
+{
+  if (ddata->dma_user_slots != NULL)
+    return ddata->dma_user_slots[slot];
+  return ddata->dma_addr + ddata->dma_slot_size * slot;
+}
 
-  case MPCIE_QUAD_8:
-  case PCI_QUAD_8:
-    {
-      int i;
-      for (i = 0; i < 8; i++)
-      {
-        byte = inb(ddata->regions[2].start + 0x8 * i + 7);
-        if (0 == (byte & 0x80))
-          break;
+/* Rings the CPU sees through its caches need explicit ownership handoffs:
+ * pinned user buffers and noncoherent driver rings. Only the DMA engine
+ * writes them; the FIFO drain fills its ring from the CPU.
+ */
+static bool apci_dma_streaming(struct apci_my_info *ddata)
+{
+  return (ddata->dma_user_slots != NULL || ddata->dma_pages != NULL) && apci_is_dma_capable(ddata);
+}
 
-        if (byte & 0x08)
-          outb(0x08, ddata->regions[2].start + 0x8 * i + 6);
-      }
-    }
-    break;
+/* Give a slot to the device and return its bus address. IRQ context. */
+static dma_addr_t apci_dma_slot_for_device(struct apci_my_info *ddata, int slot)
+{
+  dma_addr_t addr = apci_dma_slot_addr(ddata, slot);
 
-  case PCIe_IDIO_12:
-  case PCIe_IDIO_24:
-    /* read 32 bits from +8 to determine which specific bits have generated a CoS IRQ then write the same value back to +8 to clear those CoS latches */
-    dword = inl(ddata->regions[2].start + 0x8);
-    outl(dword, ddata->regions[2].start + 0x8);
-    break;
+  if (apci_dma_streaming(ddata))
+    dma_sync_single_for_device(&ddata->pci_dev->dev, addr, ddata->dma_slot_size, DMA_FROM_DEVICE);
+  return addr;
+}
 
+int apci_is_dma_capable(struct apci_my_info *ddata)
+{
+  switch (ddata->dev_id)
+  {
   case mPCIe_AIO16_16F_proto:
   case mPCIe_AIO16_16A_proto:
   case mPCIe_AIO16_16E_proto:
@@ -1542,23 +1585,1847 @@ irqreturn_t apci_interrupt(int irq, void *dev_id)
   case mPCIe_AIO12_16E_proto:
   case mPCIe_AI12_16A_proto:
   case mPCIe_AI12_16_proto:
-  case mPCIe_AI12_16E_proto: // DMA capable cards
+  case mPCIe_AI12_16E_proto:
+    return 1;
+  default:
+    return apci_is_axio(ddata);
+  }
+}
+
+/* 64-bit addressing and the optional preallocated ring, at probe. The
+ * coherent allocator already takes the card's NUMA node (and CMA when the
+ * kernel has it).
+ */
+static void apci_dma_setup(struct apci_my_info *ddata)
+{
+  struct device *dev = &ddata->pci_dev->dev;
+
+  if (!apci_is_dma_capable(ddata))
+    return;
+
+  if (dma_set_mask_and_coherent(dev, DMA_BIT_MASK(64)) &&
+      dma_set_mask_and_coherent(dev, DMA_BIT_MASK(32)))
+    apci_error("no usable DMA mask\n");
+
+  if (dma_prealloc_kb == 0)
+    return;
+  ddata->dma_prealloc_size = (size_t)dma_prealloc_kb * 1024;
+  ddata->dma_prealloc_virt = dma_alloc_coherent(dev, ddata->dma_prealloc_size,
+                                                &ddata->dma_prealloc_addr, GFP_KERNEL);
+  if (ddata->dma_prealloc_virt == NULL)
   {
-    apci_devel("ISR: mPCIe-AI irq_event\n");
-    // If this is a FIFO near full IRQ then tell the card
-    // to write to the next buffer (and don't notify the user?)
-    // else if it is a write done IRQ set last_valid_buffer and notify user
-    irq_event = ioread8(ddata->regions[2].mapped_address + 0x2);
-    if (irq_event == 0)
-    {
-      apci_devel("ISR: not our IRQ\n");
-      return IRQ_NONE;
-    }
+    apci_error("could not preallocate %u KiB DMA ring\n", dma_prealloc_kb);
+    ddata->dma_prealloc_size = 0;
+  }
+}
 
-    if (irq_event & 0x1) // FIFO almost full
+static void apci_dma_free_prealloc(struct apci_my_info *ddata)
+{
+  if (ddata->dma_prealloc_virt == NULL)
+    return;
+  dma_free_coherent(&ddata->pci_dev->dev, ddata->dma_prealloc_size,
+                    ddata->dma_prealloc_virt, ddata->dma_prealloc_addr);
+  ddata->dma_prealloc_virt = NULL;
+  ddata->dma_prealloc_size = 0;
+}
+
+/* The per-slot metadata ring that goes with a new DMA ring; mappable, so
+ * from vmalloc_user, which zeroes it. It goes in last under dma_data_lock,
+ * after the indices are rewound for the new ring, and the IRQ paths and
+ * readers leave the ring alone until it is there.
+ */
+static int apci_dma_alloc_meta(struct apci_my_info *ddata)
+{
+  slot_meta_t *meta = vmalloc_user(PAGE_ALIGN(ddata->dma_num_slots * sizeof(slot_meta_t)));
+  unsigned long flags;
+
+  if (meta == NULL)
+    return -ENOMEM;
+  apci_level_reset(ddata);
+  spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+  apci_dma_rewind_locked(ddata);
+  ddata->dma_slot_meta = meta;
+  spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+  return 0;
+}
+
+/* Set up a driver-owned ring, from the preallocation when it fits. Process
+ * context, after apci_dma_free_ring().
+ */
+int apci_dma_alloc_ring(struct apci_my_info *ddata, int num_slots, size_t slot_size)
+{
+  size_t length;
+
+  if (num_slots <= 0 || slot_size == 0 || (size_t)num_slots > SIZE_MAX / slot_size)
+    return -EINVAL;
+  length = (size_t)num_slots * slot_size;
+
+  if (ddata->dma_noncoherent)
+  {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+    ddata->dma_pages = dma_alloc_pages(&(ddata->pci_dev->dev), length, &(ddata->dma_addr),
+                                       DMA_FROM_DEVICE, GFP_KERNEL);
+    if (ddata->dma_pages == NULL)
+      return -ENOMEM;
+    ddata->dma_virt_addr = page_address(ddata->dma_pages);
+#else
+    return -EOPNOTSUPP;
+#endif
+  }
+  else if (length <= ddata->dma_prealloc_size)
+  {
+    ddata->dma_virt_addr = ddata->dma_prealloc_virt;
+    ddata->dma_addr = ddata->dma_prealloc_addr;
+  }
+  else
+  {
+    ddata->dma_virt_addr = dma_alloc_coherent(&(ddata->pci_dev->dev), length,
+                                              &(ddata->dma_addr), GFP_KERNEL);
+    if (ddata->dma_virt_addr == NULL)
+      return -ENOMEM;
+  }
+  ddata->dma_num_slots = num_slots;
+  ddata->dma_slot_size = slot_size;
+  if (apci_dma_alloc_meta(ddata))
+  {
+    apci_dma_free_ring(ddata);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+/* Free whichever kind of ring is set up. Process context, DMA stopped. */
+void apci_dma_free_ring(struct apci_my_info *ddata)
+{
+  slot_meta_t *meta;
+  unsigned long flags;
+  int slot;
+
+  /* take the ring away from the IRQ paths and wait out a running ISR;
+   * the indices go back to empty so no reader sees slots ready
+   */
+  spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+  meta = ddata->dma_slot_meta;
+  ddata->dma_slot_meta = NULL;
+  apci_dma_rewind_locked(ddata);
+  spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+  if (ddata->irq_capable)
+    synchronize_irq(ddata->irq);
+  /* the ISR can no longer queue level work; let a running scan finish */
+  apci_level_reset(ddata);
+
+  if (ddata->dma_user_pages != NULL)
+  {
+    for (slot = 0; slot < ddata->dma_num_slots; slot++)
+      dma_unmap_page(&ddata->pci_dev->dev, ddata->dma_user_slots[slot],
+                     ddata->dma_slot_size, DMA_FROM_DEVICE);
+    vunmap(ddata->dma_user_vmap);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+    unpin_user_pages_dirty_lock(ddata->dma_user_pages, ddata->dma_user_npages, true);
+#endif
+    kvfree(ddata->dma_user_pages);
+    kvfree(ddata->dma_user_slots);
+    ddata->dma_user_pages = NULL;
+    ddata->dma_user_slots = NULL;
+    ddata->dma_user_vmap = NULL;
+    ddata->dma_user_npages = 0;
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+  else if (ddata->dma_pages != NULL)
+  {
+    dma_free_pages(&(ddata->pci_dev->dev),
+                   ddata->dma_num_slots * ddata->dma_slot_size,
+                   ddata->dma_pages,
+                   ddata->dma_addr,
+                   DMA_FROM_DEVICE);
+    ddata->dma_pages = NULL;
+  }
+#endif
+  else if (ddata->dma_virt_addr != NULL && ddata->dma_virt_addr != ddata->dma_prealloc_virt)
+  {
+    dma_free_coherent(&(ddata->pci_dev->dev),
+                      ddata->dma_num_slots * ddata->dma_slot_size,
+                      ddata->dma_virt_addr,
+                      ddata->dma_addr);
+  }
+
+  vfree(meta);
+  ddata->ring_ctl->num_slots = 0;
+  ddata->ring_ctl->slot_size = 0;
+  ddata->dma_num_slots = 0;
+  ddata->dma_virt_addr = NULL;
+  ddata->dma_addr = 0;
+  ddata->dma_slot_size = 0;
+  memset(&ddata->dma_latency, 0, sizeof(ddata->dma_latency));
+  ddata->dma_xfer_size = 0;
+}
+
+/* Pin a user buffer and make it the DMA ring. Process context, after
+ * apci_dma_free_ring().
+ */
+int apci_dma_map_user(struct apci_my_info *ddata, const dma_user_buffer_t *buffer)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+  struct device *dev = &ddata->pci_dev->dev;
+  unsigned long offset = buffer->addr & ~PAGE_MASK;
+  u64 length = (u64)buffer->num_slots * buffer->slot_size;
+  unsigned long npages;
+  struct page **pages;
+  dma_addr_t *slots;
+  void *vaddr;
+  u64 start, first, last, i;
+  long pinned;
+  int slot;
+  int ret = -EINVAL;
+
+  if (buffer->num_slots < 2 || buffer->slot_size == 0 || buffer->slot_size % 4)
+    return -EINVAL;
+  npages = DIV_ROUND_UP(offset + length, PAGE_SIZE);
+  if (npages > INT_MAX)
+    return -EINVAL;
+
+  pages = kvmalloc_array(npages, sizeof(*pages), GFP_KERNEL);
+  slots = kvmalloc_array(buffer->num_slots, sizeof(*slots), GFP_KERNEL);
+  if (pages == NULL || slots == NULL)
+  {
+    ret = -ENOMEM;
+    goto out_free;
+  }
+
+  pinned = pin_user_pages_fast(buffer->addr & PAGE_MASK, npages, FOLL_WRITE | FOLL_LONGTERM, pages);
+  if (pinned < 0)
+  {
+    ret = pinned;
+    goto out_free;
+  }
+  if (pinned != npages)
+    goto out_unpin;
+
+  /* the engine takes one address per slot */
+  for (slot = 0; slot < buffer->num_slots; slot++)
+  {
+    start = offset + (u64)slot * buffer->slot_size;
+    first = start >> PAGE_SHIFT;
+    last = (start + buffer->slot_size - 1) >> PAGE_SHIFT;
+    for (i = first; i < last; i++)
+      if (page_to_pfn(pages[i + 1]) != page_to_pfn(pages[i]) + 1)
+      {
+        apci_error("DMA slot %d is not physically contiguous\n", slot);
+        goto out_unpin;
+      }
+  }
+
+  vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+  if (vaddr == NULL)
+  {
+    ret = -ENOMEM;
+    goto out_unpin;
+  }
+
+  for (slot = 0; slot < buffer->num_slots; slot++)
+  {
+    start = offset + (u64)slot * buffer->slot_size;
+    slots[slot] = dma_map_page(dev, pages[start >> PAGE_SHIFT], start & ~PAGE_MASK,
+                               buffer->slot_size, DMA_FROM_DEVICE);
+    if (dma_mapping_error(dev, slots[slot]))
+    {
+      while (--slot >= 0)
+        dma_unmap_page(dev, slots[slot], buffer->slot_size, DMA_FROM_DEVICE);
+      vunmap(vaddr);
+      ret = -ENOMEM;
+      goto out_unpin;
+    }
+  }
+
+  ddata->dma_user_pages = pages;
+  ddata->dma_user_npages = npages;
+  ddata->dma_user_slots = slots;
+  ddata->dma_user_vmap = vaddr;
+  ddata->dma_virt_addr = (u8 *)vaddr + offset;
+  ddata->dma_num_slots = buffer->num_slots;
+  ddata->dma_slot_size = buffer->slot_size;
+  if (apci_dma_alloc_meta(ddata))
+  {
+    apci_dma_free_ring(ddata);
+    return -ENOMEM;
+  }
+  return 0;
+
+out_unpin:
+  unpin_user_pages(pages, pinned);
+out_free:
+  kvfree(slots);
+  kvfree(pages);
+  return ret;
+#else
+  return -EOPNOTSUPP;
+#endif
+}
+
+/* Start the shared ring indices over for a new DMA ring. The ISR must not
+ * be producing.
+ */
+void apci_ring_reset(struct apci_my_info *ddata)
+{
+  dma_ring_ctl_t *ctl = ddata->ring_ctl;
+
+  WRITE_ONCE(ctl->producer, 0);
+  WRITE_ONCE(ctl->consumer, 0);
+  WRITE_ONCE(ctl->oldest, 0);
+  /* a multiple of num_slots, so index % num_slots does not jump on wrap */
+  ctl->index_wrap = ddata->dma_num_slots ? (0x80000000u / ddata->dma_num_slots) * ddata->dma_num_slots : 1;
+  ctl->overruns = 0;
+  ctl->num_slots = ddata->dma_num_slots;
+  ctl->slot_size = ddata->dma_slot_size;
+  ddata->read_offset = 0;
+}
+
+/* Caller holds dma_data_lock. */
+static void apci_dma_rewind_locked(struct apci_my_info *ddata)
+{
+  struct apci_file *file;
+
+  ddata->dma_last_buffer = -1;
+  ddata->dma_first_valid = -1;
+  ddata->dma_data_discarded = 0;
+  ddata->dma_discarded_total = 0;
+  ddata->fifo_fill = 0;
+  ddata->dma_slot_seq = 0;
+  ddata->dma_overrun_pending = 0;
+  ddata->dma_dropped_newest = 0;
+  ddata->dma_xfer_inflight = 0;
+  list_for_each_entry(file, &ddata->dma_cursors, cursor_list)
+  {
+    file->cursor = 0;
+    file->discarded = 0;
+    file->dropped_seen = 0;
+    file->read_offset = 0;
+  }
+  if (ddata->dma_slot_meta != NULL)
+    memset(ddata->dma_slot_meta, 0, ddata->dma_num_slots * sizeof(slot_meta_t));
+  apci_ring_reset(ddata);
+}
+
+/* Rewind an existing ring to empty without touching its memory, for the
+ * next acquisition run. Process context, with read_lock held so read()
+ * does not run across it.
+ */
+void apci_dma_rewind(struct apci_my_info *ddata)
+{
+  unsigned long flags;
+
+  apci_level_reset(ddata);
+  spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+  apci_dma_rewind_locked(ddata);
+  spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+}
+
+/* The first unread slot still intact: the consumer index, or oldest when
+ * the ring policy has overwritten slots the consumer had not got to.
+ * Caller holds dma_data_lock.
+ */
+__u32 apci_ring_tail_locked(struct apci_my_info *ddata)
+{
+  dma_ring_ctl_t *ctl = ddata->ring_ctl;
+  __u32 consumer = smp_load_acquire(&ctl->consumer) % ctl->index_wrap;
+
+  if (apci_ring_after(ctl, ctl->oldest, consumer))
+    return ctl->oldest;
+  return consumer;
+}
+
+/* Pick up the consumer index the user may have moved through the mapped
+ * control page. Caller holds dma_data_lock.
+ */
+void apci_ring_sync_locked(struct apci_my_info *ddata)
+{
+  dma_ring_ctl_t *ctl = ddata->ring_ctl;
+  __u32 producer = ctl->producer;
+  __u32 consumer = apci_ring_tail_locked(ddata);
+
+  if (ddata->dma_first_valid == -1 || ddata->dma_num_slots == 0)
+    return;
+  /* ignore a consumer that ran past the producer */
+  if (apci_ring_after(ctl, consumer, producer))
+    consumer = producer;
+  ddata->dma_first_valid = consumer % ddata->dma_num_slots;
+}
+
+/* Release slots on the user's behalf (data_done). Caller holds dma_data_lock. */
+void apci_ring_consume_locked(struct apci_my_info *ddata, __u32 slots)
+{
+  dma_ring_ctl_t *ctl = ddata->ring_ctl;
+
+  if (ddata->dma_first_valid == -1)
+    return;
+  smp_store_release(&ctl->consumer, apci_ring_add(ctl, apci_ring_tail_locked(ddata), slots));
+  apci_ring_sync_locked(ddata);
+}
+
+/* The engine just moved onto the oldest unread slot. Either keep the
+ * reader's data and rewrite the newest slot instead (returns true), or in
+ * overwrite-oldest mode drop the oldest slot and carry on (returns
+ * false). With per-file cursors but none of them lossless nobody needs
+ * the oldest slot, so it is always overwritten. The consumer index
+ * belongs to the user, so dropping a slot moves oldest instead, along
+ * with whatever read() had taken of that slot. Caller holds dma_data_lock.
+ */
+static bool apci_ring_full_locked(struct apci_my_info *ddata)
+{
+  ddata->dma_data_discarded++;
+  ddata->dma_discarded_total++;
+  ddata->ring_ctl->overruns++;
+
+  if (ddata->dma_ring_policy == APCI_RING_OVERWRITE_OLDEST ||
+      (!list_empty(&ddata->dma_cursors) && ddata->dma_lossless_cursors == 0))
+  {
+    ddata->dma_first_valid = (ddata->dma_first_valid + 1) % ddata->dma_num_slots;
+    WRITE_ONCE(ddata->ring_ctl->oldest, apci_ring_add(ddata->ring_ctl, apci_ring_tail_locked(ddata), 1));
+    ddata->read_offset = 0;
+    return false;
+  }
+
+  apci_error("ISR: data discarded");
+  ddata->dma_dropped_newest++;
+  ddata->dma_slot_seq++; /* the lost slot shows as a gap in slot_meta_t.seq */
+  ddata->dma_last_buffer--;
+  if (ddata->dma_last_buffer < 0)
+    ddata->dma_last_buffer = ddata->dma_num_slots - 1;
+  ddata->dma_overrun_pending = 1;
+  return true;
+}
+
+/* A slot completed with bytes of data: describe it in the metadata ring
+ * and publish it. Caller holds dma_data_lock.
+ */
+static void apci_ring_produce_locked(struct apci_my_info *ddata, __u32 fifo_level, __u32 bytes)
+{
+  int completed = (ddata->dma_last_buffer + ddata->dma_num_slots - 1) % ddata->dma_num_slots;
+  slot_meta_t *meta = &ddata->dma_slot_meta[completed];
+
+  if (apci_dma_streaming(ddata))
+    dma_sync_single_for_cpu(&ddata->pci_dev->dev, apci_dma_slot_addr(ddata, completed),
+                            ddata->dma_slot_size, DMA_FROM_DEVICE);
+
+  meta->timestamp_ns = ktime_get_ns();
+  WRITE_ONCE(ddata->dma_last_complete_ns, meta->timestamp_ns);
+  meta->seq = ddata->dma_slot_seq++;
+  meta->fifo_level = fifo_level;
+  meta->flags = ddata->dma_overrun_pending ? APCI_SLOT_AFTER_OVERRUN : 0;
+  if (bytes < ddata->dma_slot_size)
+    meta->flags |= APCI_SLOT_PARTIAL;
+  meta->bytes = bytes;
+  ddata->dma_overrun_pending = 0;
+
+  smp_store_release(&ddata->ring_ctl->producer, apci_ring_add(ddata->ring_ctl, ddata->ring_ctl->producer, 1));
+}
+
+/* FIFO entries per second the AxIO ADC produces at a given divisor. */
+static u64 apci_axio_entry_hz(struct apci_my_info *ddata, __u32 divisor)
+{
+  if (divisor == 0)
+    return 0;
+  return ioread32(ddata->regions[1].mapped_address + mPCIe_ADIO_BaseClockOffset) / divisor;
+}
+
+/* Size AxIO transfers for dma_latency at entry_hz, fill in what that
+ * achieves and program the FAF threshold to match. Caller holds
+ * dma_data_lock.
+ */
+static void apci_dma_tune_locked(struct apci_my_info *ddata, u64 entry_hz)
+{
+  dma_latency_t *lat = &ddata->dma_latency;
+  u64 entries;
+
+  entries = div_u64(entry_hz * lat->latency_us + USEC_PER_SEC / 2, USEC_PER_SEC);
+  entries = clamp_t(u64, entries, 1,
+                    min_t(u64, mPCIe_ADIO_FAFMax, ddata->dma_slot_size / mPCIe_ADIO_FIFOEntryBytes));
+
+  lat->faf_threshold = entries;
+  lat->slot_bytes = entries * mPCIe_ADIO_FIFOEntryBytes;
+  lat->irq_rate_milli_hz = min_t(u64, div64_u64(entry_hz * 1000, entries), U32_MAX);
+  lat->achieved_us = min_t(u64, div64_u64(entries * USEC_PER_SEC, entry_hz), U32_MAX);
+  ddata->dma_xfer_size = lat->slot_bytes;
+  iowrite32(entries, ddata->regions[1].mapped_address + mPCIe_ADIO_FAFThresholdOffset);
+}
+
+int apci_set_dma_latency_cfg(struct apci_my_info *ddata, dma_latency_t *lat)
+{
+  unsigned long flags;
+  u64 entry_hz;
+
+  if (!apci_is_axio(ddata))
+    return -EOPNOTSUPP;
+  if (ddata->dma_virt_addr == NULL)
+    return -ENODEV;
+  if (ddata->dma_slot_size < mPCIe_ADIO_FIFOEntryBytes)
+    return -EINVAL;
+
+  if (lat->sample_hz)
+    entry_hz = (u64)lat->sample_hz * max_t(__u32, lat->channels, 1);
+  else
+    entry_hz = apci_axio_entry_hz(ddata, ioread32(ddata->regions[1].mapped_address + mPCIe_ADIO_DivisorOffset));
+  if (lat->latency_us && entry_hz == 0)
+    return -EINVAL;
+
+  spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+  memset(&ddata->dma_latency, 0, sizeof(ddata->dma_latency));
+  ddata->dma_xfer_size = 0;
+  if (lat->latency_us)
+  {
+    ddata->dma_latency.sample_hz = lat->sample_hz;
+    ddata->dma_latency.channels = lat->channels;
+    ddata->dma_latency.latency_us = lat->latency_us;
+    apci_dma_tune_locked(ddata, entry_hz);
+  }
+  *lat = ddata->dma_latency;
+  spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+  return 0;
+}
+
+/* The user is writing the AxIO divisor: follow the new rate if the
+ * latency target asked to.
+ */
+static void apci_dma_retune(struct apci_my_info *ddata, __u32 divisor)
+{
+  u64 entry_hz = apci_axio_entry_hz(ddata, divisor);
+  unsigned long flags;
+
+  if (entry_hz == 0)
+    return;
+
+  spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+  if (ddata->dma_latency.latency_us && ddata->dma_latency.sample_hz == 0)
+    apci_dma_tune_locked(ddata, entry_hz);
+  spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+}
+
+/* Handle one AxIO IRQ status word, from the ISR or from poll_timer.
+ * Returns true if the user should be notified.
+ */
+static bool apci_axio_service(struct apci_my_info *ddata, __u32 irq_event)
+{
+  bool notify_user = true;
+  bool dropped = false;
+
+  // If this is a FIFO near full IRQ then tell the card
+  // to write to the next buffer (and don't notify the user)
+  // else if it is a write done IRQ set last_valid_buffer and notify user
+  if (irq_event & (bmADIO_ADCTRIGGERStatus | bmADIO_DMADoneStatus))
+  {
+    dma_addr_t base;
+    __u32 bytes;
+    spin_lock(&(ddata->dma_data_lock));
+    if (ddata->dma_slot_meta == NULL)
+    {
+      /* no ring, or it is being freed */
+      spin_unlock(&(ddata->dma_data_lock));
+      notify_user = false;
+      goto out_clear;
+    }
+    apci_ring_sync_locked(ddata);
+    if (ddata->dma_last_buffer == -1)
+    {
+      notify_user = false;
+      apci_debug("ISR First IRQ");
+      atomic_set(&ddata->level_slots, 0);
+      atomic_set(&ddata->level_restart, 1);
+    }
+    else if (ddata->dma_first_valid == -1)
+    {
+      ddata->dma_first_valid = 0;
+    }
+
+    ddata->dma_last_buffer++;
+    ddata->dma_last_buffer %= ddata->dma_num_slots;
+
+    if (ddata->dma_last_buffer == ddata->dma_first_valid)
+      dropped = apci_ring_full_locked(ddata);
+    if (!dropped && notify_user)
+    {
+      apci_ring_produce_locked(ddata, ioread32(ddata->regions[1].mapped_address + 0x28),
+                               ddata->dma_xfer_inflight ? ddata->dma_xfer_inflight : ddata->dma_slot_size);
+      if (READ_ONCE(ddata->level.enable))
+      {
+        /* read() and poll() follow the slots; the level trigger decides
+         * the event, and with it apci_wait_for_data
+         */
+        wake_up_interruptible(&(ddata->dma_wait_queue));
+        atomic_inc(&ddata->level_slots);
+        queue_work(system_highpri_wq, &ddata->level_work);
+        notify_user = false;
+      }
+    }
+    base = apci_dma_slot_for_device(ddata, ddata->dma_last_buffer);
+    bytes = ddata->dma_xfer_size ? ddata->dma_xfer_size : ddata->dma_slot_size;
+    ddata->dma_xfer_inflight = bytes;
+
+    /* program the engine before the ring can be freed under us */
+    iowrite32(base & 0xffffffff, ddata->regions[0].mapped_address + 0x10);
+    iowrite32(base >> 32, ddata->regions[0].mapped_address + 4 + 0x10);
+    iowrite32(bytes, ddata->regions[0].mapped_address + 8 + 0x10);
+    iowrite32(4, ddata->regions[0].mapped_address + 12 + 0x10);
+    spin_unlock(&(ddata->dma_data_lock));
+    udelay(5); // ?
+  }
+
+out_clear:
+  iowrite32(irq_event, ddata->regions[1].mapped_address + mPCIe_ADIO_IRQStatusAndClearOffset); // clear whatever IRQ occurred and retain enabled IRQ sources // TODO: Upgrade to doRegisterAction("Clear&Enable")
+  apci_debug("ISR: irq_event = 0x%x, depth = 0x%x, IRQStatus = 0x%x\n", irq_event, ioread32(ddata->regions[1].mapped_address + 0x28), ioread32(ddata->regions[1].mapped_address + 0x40));
+  return notify_user;
+}
+
+/* Publish an event on the status page. IRQ context. */
+static void apci_status_publish(struct apci_my_info *ddata, __u32 raw_status)
+{
+  status_page_t *page = ddata->status_page;
+
+  spin_lock(&(ddata->status_lock));
+  WRITE_ONCE(page->seq, page->seq + 1);
+  smp_wmb();
+  page->last_status = raw_status;
+  page->event_count++;
+  page->last_event_ns = ktime_get_ns();
+  page->dma_last_buffer = ddata->dma_last_buffer;
+  page->dma_first_valid = ddata->dma_first_valid;
+  page->dma_data_discarded = ddata->dma_discarded_total;
+  smp_wmb();
+  WRITE_ONCE(page->seq, page->seq + 1);
+  spin_unlock(&(ddata->status_lock));
+}
+
+/* Deliver an event: publish status on the status page, wake the user and
+ * queue the action rules with the same status word. The ISR returns
+ * IRQ_WAKE_THREAD for the rules itself; from the poll timer, the debounce
+ * timer or level work (in_isr false) the IRQ thread is woken here.
+ * IRQ context, or with interrupts off.
+ */
+static void apci_event_deliver(struct apci_my_info *ddata, __u32 status, bool in_isr)
+{
+  apci_status_publish(ddata, status);
+  apci_notify(ddata);
+  if (!READ_ONCE(ddata->action_count))
+    return;
+
+  atomic_or(status, &ddata->action_status);
+  WRITE_ONCE(ddata->action_irq_ns, ktime_get_ns());
+  atomic_inc(&ddata->action_pending);
+  if (!in_isr && ddata->irq_capable)
+    irq_wake_thread(ddata->irq, ddata);
+}
+
+/* Scan the completed DMA slots for level crossings on the configured
+ * channel and wake the user once per slot that has any. The ring is
+ * checked under dma_data_lock before each slot; apci_dma_free_ring()
+ * unpublishes it and then waits for this work before freeing it.
+ */
+static void apci_level_work_fn(struct work_struct *work)
+{
+  struct apci_my_info *ddata = container_of(work, struct apci_my_info, level_work);
+  const level_trigger_t *level = &ddata->level;
+  __u32 samples;
+  unsigned long flags;
+  int num_slots;
+  __le32 *slot_data;
+  __u32 word;
+  __s16 value;
+  int above;
+  bool crossed;
+  __u32 i;
+
+  if (atomic_xchg(&ddata->level_restart, 0))
+  {
+    ddata->level_scan_slot = 0;
+    ddata->level_above = -1;
+  }
+
+  while (atomic_add_unless(&ddata->level_slots, -1, 0))
+  {
+    crossed = false;
+    spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+    if (ddata->dma_slot_meta == NULL || ddata->dma_virt_addr == NULL)
+    {
+      spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+      atomic_set(&ddata->level_slots, 0);
+      break;
+    }
+    num_slots = ddata->dma_num_slots;
+    samples = ddata->dma_slot_meta[ddata->level_scan_slot].bytes / sizeof(__u32);
+    slot_data = (__le32 *)((u8 *)ddata->dma_virt_addr + ddata->dma_slot_size * ddata->level_scan_slot);
+    spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+    for (i = 0; i < samples; i++)
+    {
+      word = le32_to_cpu(READ_ONCE(slot_data[i]));
+      if (((word >> 20) & 0xF) != level->channel)
+        continue;
+      value = (__s16)(word & 0xFFFF);
+      above = value > level->threshold;
+      if (ddata->level_above >= 0 && above != ddata->level_above &&
+          (level->direction & (above ? APCI_LEVEL_RISING : APCI_LEVEL_FALLING)))
+      {
+        spin_lock_irqsave(&(ddata->level_lock), flags);
+        ddata->level_crossing.count++;
+        ddata->level_crossing.slot = ddata->level_scan_slot;
+        ddata->level_crossing.sample = i;
+        ddata->level_crossing.value = value;
+        ddata->level_crossing.direction = above ? APCI_LEVEL_RISING : APCI_LEVEL_FALLING;
+        ddata->level_crossing.timestamp_ns = ktime_get_ns();
+        spin_unlock_irqrestore(&(ddata->level_lock), flags);
+        crossed = true;
+      }
+      ddata->level_above = above;
+    }
+
+    ddata->level_crossing.slots_scanned++;
+    ddata->level_scan_slot = (ddata->level_scan_slot + 1) % num_slots;
+
+    if (crossed)
+    {
+      /* the notify path takes its locks as if called from the ISR */
+      local_irq_save(flags);
+      apci_event_deliver(ddata, bmADIO_DMADoneStatus, false);
+      local_irq_restore(flags);
+    }
+  }
+}
+
+/* Stop scanning before the DMA ring goes away or the trigger changes.
+ * Process context only.
+ */
+void apci_level_reset(struct apci_my_info *ddata)
+{
+  cancel_work_sync(&ddata->level_work);
+  atomic_set(&ddata->level_slots, 0);
+  atomic_set(&ddata->level_restart, 1);
+}
+
+int apci_set_level_trigger_cfg(struct apci_my_info *ddata, const level_trigger_t *level)
+{
+  unsigned long flags;
+
+  if (!apci_is_axio(ddata))
+    return -EOPNOTSUPP;
+  if (level->enable && (level->channel > 0xF || level->direction & ~APCI_LEVEL_BOTH))
+    return -EINVAL;
+
+  WRITE_ONCE(ddata->level.enable, 0);
+  apci_level_reset(ddata);
+  spin_lock_irqsave(&(ddata->level_lock), flags);
+  memset(&ddata->level_crossing, 0, sizeof(ddata->level_crossing));
+  spin_unlock_irqrestore(&(ddata->level_lock), flags);
+  ddata->level = *level;
+  /* slots already in the ring were never queued for scanning */
+  atomic_set(&ddata->level_restart, 0);
+  ddata->level_scan_slot = ddata->dma_last_buffer < 0 ? 0 : ddata->dma_last_buffer;
+  ddata->level_above = -1;
+  smp_wmb();
+  WRITE_ONCE(ddata->level.enable, level->enable);
+  return 0;
+}
+
+/* Account the CoS latch of a PCIe-IDIO card to the per-bit edge counters. IRQ context. */
+static void apci_edges_update(struct apci_my_info *ddata, __u32 cos)
+{
+  edge_counters_t *edges = ddata->edge_counters;
+  __u32 state = inl(ddata->regions[2].start + 0x4);
+  u64 now = ktime_get_ns();
+  unsigned long bits = cos;
+  int bit;
+
+  spin_lock(&(ddata->status_lock));
+  WRITE_ONCE(edges->seq, edges->seq + 1);
+  smp_wmb();
+  for_each_set_bit(bit, &bits, APCI_EDGE_BITS)
+  {
+    __u32 was = (edges->state >> bit) & 1;
+    __u32 is = (state >> bit) & 1;
+
+    if (is && !was)
+      edges->rising[bit]++;
+    else if (!is && was)
+      edges->falling[bit]++;
+    else
+    {
+      /* a full pulse between latch and read */
+      edges->rising[bit]++;
+      edges->falling[bit]++;
+    }
+    edges->last_edge_ns[bit] = now;
+  }
+  edges->state = state;
+  smp_wmb();
+  WRITE_ONCE(edges->seq, edges->seq + 1);
+  spin_unlock(&(ddata->status_lock));
+}
+
+void apci_reset_edges(struct apci_my_info *ddata)
+{
+  edge_counters_t *edges = ddata->edge_counters;
+  unsigned long flags;
+
+  spin_lock_irqsave(&(ddata->status_lock), flags);
+  WRITE_ONCE(edges->seq, edges->seq + 1);
+  smp_wmb();
+  memset(edges->rising, 0, sizeof(edges->rising));
+  memset(edges->falling, 0, sizeof(edges->falling));
+  memset(edges->last_edge_ns, 0, sizeof(edges->last_edge_ns));
+  edges->state = inl(ddata->regions[2].start + 0x4);
+  smp_wmb();
+  WRITE_ONCE(edges->seq, edges->seq + 1);
+  spin_unlock_irqrestore(&(ddata->status_lock), flags);
+}
+
+#define QUAD_COUNTER_BITS 24
+#define QUAD_CMD_RESET_COUNTER 0x01
+#define QUAD_CMD_LOAD_ODR 0x04
+#define QUAD_FLAG_UP 0x20 /* status at +7: counting up, so a wrap was a carry */
+
+int apci_quad_channels(struct apci_my_info *ddata)
+{
+  switch (ddata->dev_id)
+  {
+  case MPCIE_QUAD_4:
+  case PCI_QUAD_4:
+    return 4;
+  case MPCIE_QUAD_8:
+  case PCI_QUAD_8:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+/* Latch count channels starting at first back to back, then fold each
+ * 24-bit hardware count into its 64-bit position. wrap is +1 or -1 when a
+ * carry or borrow IRQ says the counter just wrapped that way, else 0.
+ */
+static void apci_quad_fold(struct apci_my_info *ddata, int first, int count, int wrap)
+{
+  quad_state_t *quad = ddata->quad;
+  unsigned long flags;
+  __s32 delta;
+  __u32 raw;
+  int ch;
+
+  spin_lock_irqsave(&(ddata->quad_lock), flags);
+  for (ch = first; ch < first + count; ch++)
+    outb(QUAD_CMD_LOAD_ODR, ddata->regions[2].start + 6 + ch * 8);
+
+  WRITE_ONCE(quad->seq, quad->seq + 1);
+  smp_wmb();
+  quad->timestamp_ns = ktime_get_ns();
+  for (ch = first; ch < first + count; ch++)
+  {
+    raw = inl(ddata->regions[2].start + 2 + ch * 8) & ((1 << QUAD_COUNTER_BITS) - 1);
+    /* sign-extended 24-bit difference: right while fewer than 2^23 counts
+     * pass between samples. Past that it comes out with the wrong sign,
+     * and on a carry or borrow the wrap direction settles it.
+     */
+    delta = (__s32)((raw - ddata->quad_raw[ch]) << (32 - QUAD_COUNTER_BITS)) >> (32 - QUAD_COUNTER_BITS);
+    if (wrap > 0 && delta < 0)
+      delta += 1 << QUAD_COUNTER_BITS;
+    else if (wrap < 0 && delta > 0)
+      delta -= 1 << QUAD_COUNTER_BITS;
+    quad->position[ch] += delta;
+    ddata->quad_raw[ch] = raw;
+  }
+  smp_wmb();
+  WRITE_ONCE(quad->seq, quad->seq + 1);
+  spin_unlock_irqrestore(&(ddata->quad_lock), flags);
+}
+
+/* Any context. */
+void apci_quad_sample(struct apci_my_info *ddata, int first, int count)
+{
+  apci_quad_fold(ddata, first, count, 0);
+}
+
+/* The user reset a channel's hardware counter: restart its position at 0. */
+static void apci_quad_reset(struct apci_my_info *ddata, int ch)
+{
+  quad_state_t *quad = ddata->quad;
+  unsigned long flags;
+
+  spin_lock_irqsave(&(ddata->quad_lock), flags);
+  WRITE_ONCE(quad->seq, quad->seq + 1);
+  smp_wmb();
+  quad->position[ch] = 0;
+  quad->velocity[ch] = 0;
+  ddata->quad_prev_position[ch] = 0;
+  ddata->quad_raw[ch] = 0;
+  smp_wmb();
+  WRITE_ONCE(quad->seq, quad->seq + 1);
+  spin_unlock_irqrestore(&(ddata->quad_lock), flags);
+}
+
+static enum hrtimer_restart apci_quad_timer_fn(struct hrtimer *timer)
+{
+  struct apci_my_info *ddata = container_of(timer, struct apci_my_info, quad_timer);
+  quad_state_t *quad = ddata->quad;
+  int channels = apci_quad_channels(ddata);
+  s64 elapsed;
+  int ch;
+
+  apci_quad_sample(ddata, 0, channels);
+
+  spin_lock(&(ddata->quad_lock));
+  elapsed = quad->timestamp_ns - ddata->quad_prev_ns;
+  WRITE_ONCE(quad->seq, quad->seq + 1);
+  smp_wmb();
+  for (ch = 0; ch < channels; ch++)
+  {
+    if (ddata->quad_prev_ns && elapsed > 0)
+      quad->velocity[ch] = div64_s64((quad->position[ch] - ddata->quad_prev_position[ch]) * NSEC_PER_SEC, elapsed);
+    ddata->quad_prev_position[ch] = quad->position[ch];
+  }
+  smp_wmb();
+  WRITE_ONCE(quad->seq, quad->seq + 1);
+  ddata->quad_prev_ns = quad->timestamp_ns;
+  spin_unlock(&(ddata->quad_lock));
+
+  hrtimer_forward_now(timer, ns_to_ktime(ddata->quad_period_ns));
+  return HRTIMER_RESTART;
+}
+
+/* Run the velocity timer at hz; 0 stops it. Process context only. */
+void apci_quad_set_velocity_rate(struct apci_my_info *ddata, unsigned long hz)
+{
+  hrtimer_cancel(&ddata->quad_timer);
+  memset(ddata->quad->velocity, 0, sizeof(ddata->quad->velocity));
+  ddata->quad->velocity_hz = hz;
+  ddata->quad_prev_ns = 0;
+  if (hz == 0)
+    return;
+
+  ddata->quad_period_ns = div_u64(NSEC_PER_SEC, hz);
+  hrtimer_start(&ddata->quad_timer, ns_to_ktime(ddata->quad_period_ns), HRTIMER_MODE_REL);
+}
+
+/* Count events into the current rate window. Returns true when the window
+ * has just closed, with the fresh event_rate in *rate. The ISR and
+ * poll_timer both count, so the window is under irq_lock.
+ */
+static bool apci_rate_account(struct apci_my_info *ddata, unsigned int events, __u32 *rate)
+{
+  u64 now = ktime_get_ns();
+  unsigned long flags;
+  u64 elapsed;
+
+  spin_lock_irqsave(&(ddata->irq_lock), flags);
+  ddata->rate_window_events += events;
+  elapsed = now - ddata->rate_window_start;
+  if (elapsed < APCI_RATE_WINDOW_NS)
+  {
+    spin_unlock_irqrestore(&(ddata->irq_lock), flags);
+    return false;
+  }
+
+  *rate = div64_u64((u64)ddata->rate_window_events * NSEC_PER_SEC, elapsed);
+  WRITE_ONCE(ddata->event_rate, *rate);
+  ddata->rate_window_events = 0;
+  ddata->rate_window_start = now;
+  spin_unlock_irqrestore(&(ddata->irq_lock), flags);
+  return true;
+}
+
+/* Mask the card's IRQ sources and hand servicing over to poll_timer. */
+static void apci_poll_start(struct apci_my_info *ddata, __u32 irq_event, __u32 rate)
+{
+  ddata->poll_irq_enables = irq_event & ~mPCIe_ADIO_IRQEventMask;
+  WRITE_ONCE(ddata->poll_mode, 1);
+  ddata->poll_mode_switches++;
+  iowrite32(0, ddata->regions[1].mapped_address + mPCIe_ADIO_IRQStatusAndClearOffset);
+  hrtimer_start(&ddata->poll_timer, ns_to_ktime(ddata->poll_interval_ns), HRTIMER_MODE_REL);
+  apci_info("switching to polling at %u events/s\n", rate);
+}
+
+static enum hrtimer_restart apci_poll_timer_fn(struct hrtimer *timer)
+{
+  struct apci_my_info *ddata = container_of(timer, struct apci_my_info, poll_timer);
+  __u32 irq_event;
+  unsigned int events = 0;
+  bool notify_user;
+  __u32 rate;
+
+  irq_event = ioread32(ddata->regions[1].mapped_address + mPCIe_ADIO_IRQStatusAndClearOffset);
+  if (irq_event & mPCIe_ADIO_IRQEventMask)
+  {
+    events = 1;
+    ddata->polled_events++;
+    notify_user = apci_axio_service(ddata, irq_event);
+    if (notify_user)
+      apci_event_deliver(ddata, irq_event, false);
+  }
+
+  if (apci_rate_account(ddata, events, &rate) && rate < ddata->poll_exit_rate)
+  {
+    WRITE_ONCE(ddata->poll_mode, 0);
+    ddata->poll_mode_switches++;
+    iowrite32(ddata->poll_irq_enables, ddata->regions[1].mapped_address + mPCIe_ADIO_IRQStatusAndClearOffset);
+    apci_info("switching to IRQs at %u events/s\n", rate);
+    return HRTIMER_NORESTART;
+  }
+
+  hrtimer_forward_now(timer, ns_to_ktime(ddata->poll_interval_ns));
+  return HRTIMER_RESTART;
+}
+
+/* Stop polling (if active) and give the card its IRQ sources back.
+ * Process context only.
+ */
+void apci_poll_stop(struct apci_my_info *ddata)
+{
+  hrtimer_cancel(&ddata->poll_timer);
+  if (ddata->poll_mode)
+  {
+    WRITE_ONCE(ddata->poll_mode, 0);
+    ddata->poll_mode_switches++;
+    iowrite32(ddata->poll_irq_enables, ddata->regions[1].mapped_address + mPCIe_ADIO_IRQStatusAndClearOffset);
+  }
+}
+
+enum apci_rearm_family { REARM_NONE = 0, REARM_DIO, REARM_AI12 };
+
+static enum apci_rearm_family apci_rearm_family(struct apci_my_info *ddata)
+{
+  switch (ddata->dev_id)
+  {
+  case PCI_DIO_72:
+  case PCI_DIO_96:
+  case PCI_DIO_96CT:
+  case PCI_DIO_96C3:
+  case PCI_DIO_120:
+  case PCIe_DIO_72:
+  case PCIe_DIO_96:
+  case PCIe_DIO_120:
+    return REARM_DIO;
+  case PCI_AI12_16:
+  case PCI_AI12_16_:
+  case PCI_AI12_16A:
+  case PCI_AIO12_16:
+  case PCI_A12_16A:
+    return REARM_AI12;
+  default:
+    return REARM_NONE;
+  }
+}
+
+int apci_set_rearm_policy(struct apci_my_info *ddata, int enable, __u32 mask)
+{
+  if (apci_rearm_family(ddata) == REARM_NONE)
+    return -EOPNOTSUPP;
+
+  WRITE_ONCE(ddata->rearm_mask[0], mask & 0xff);
+  WRITE_ONCE(ddata->rearm_mask[1], (mask >> 8) & 0xff);
+  WRITE_ONCE(ddata->rearm, enable);
+  return 0;
+}
+
+/* The AI12 family and LPCI-A16-16A read their A/D FIFO at +0 */
+#define FIFO_DATA_OFFSET 0x0
+
+static bool apci_fifo_drain_capable(struct apci_my_info *ddata)
+{
+  return apci_rearm_family(ddata) == REARM_AI12 || ddata->dev_id == LPCI_A16_16A;
+}
+
+/* Read words 16-bit samples into the current ring slot. */
+static void apci_fifo_read(struct apci_my_info *ddata, void *dest, __u32 words)
+{
+  if (ddata->regions[2].flags & IORESOURCE_IO)
+    insw(ddata->regions[2].start + FIFO_DATA_OFFSET, dest, words);
+  else
+    ioread16_rep(ddata->regions[2].mapped_address + FIFO_DATA_OFFSET, dest, words);
+}
+
+/* The current drain slot is done with bytes of data: move on to the next
+ * one and publish it. Returns false if the ring was full and the slot
+ * dropped. Caller holds dma_data_lock.
+ */
+static bool apci_fifo_complete_locked(struct apci_my_info *ddata, __u32 bytes)
+{
+  ddata->fifo_fill = 0;
+  if (ddata->dma_first_valid == -1)
+    ddata->dma_first_valid = 0;
+  ddata->dma_last_buffer++;
+  ddata->dma_last_buffer %= ddata->dma_num_slots;
+  if (ddata->dma_last_buffer == ddata->dma_first_valid && apci_ring_full_locked(ddata))
+    return false;
+  apci_ring_produce_locked(ddata, 0, bytes);
+  return true;
+}
+
+/* Drain one FIFO interrupt's worth of samples into the DMA ring, moving
+ * dma_last_buffer on exactly like the AxIO DMA engine would. Returns true
+ * if a slot was completed. IRQ context.
+ */
+static bool apci_fifo_drain(struct apci_my_info *ddata)
+{
+  __u32 words = READ_ONCE(ddata->fifo_drain_words);
+  __u32 chunk;
+  bool completed = false;
+
+  spin_lock(&(ddata->dma_data_lock));
+  if (ddata->dma_slot_meta == NULL)
+  {
+    spin_unlock(&(ddata->dma_data_lock));
+    return false;
+  }
+  apci_ring_sync_locked(ddata);
+  if (ddata->dma_last_buffer == -1)
+  {
+    ddata->dma_last_buffer = 0;
+    ddata->fifo_fill = 0;
+  }
+
+  while (words)
+  {
+    chunk = min_t(__u32, words, (ddata->dma_slot_size - ddata->fifo_fill) / 2);
+    apci_fifo_read(ddata, (u8 *)ddata->dma_virt_addr +
+                   ddata->dma_slot_size * ddata->dma_last_buffer + ddata->fifo_fill, chunk);
+    ddata->fifo_fill += chunk * 2;
+    words -= chunk;
+    if (ddata->fifo_fill < ddata->dma_slot_size)
+      continue;
+
+    if (apci_fifo_complete_locked(ddata, ddata->dma_slot_size))
+      completed = true;
+  }
+  spin_unlock(&(ddata->dma_data_lock));
+  return completed;
+}
+
+/* Process context only; the ring must be allocated first and slots must
+ * hold whole samples.
+ */
+int apci_set_fifo_drain_cfg(struct apci_my_info *ddata, const fifo_drain_t *drain)
+{
+  if (!apci_fifo_drain_capable(ddata))
+    return -EOPNOTSUPP;
+  if (!drain->enable)
+  {
+    WRITE_ONCE(ddata->fifo_drain_words, 0);
+    return 0;
+  }
+  if (drain->words_per_irq == 0 || drain->words_per_irq > APCI_FIFO_DRAIN_MAX_WORDS)
+    return -EINVAL;
+  if (ddata->dma_virt_addr == NULL || ddata->dma_slot_size < 2 || ddata->dma_slot_size % 2)
+    return -EINVAL;
+
+  apci_dma_rewind(ddata);
+  WRITE_ONCE(ddata->fifo_drain_words, drain->words_per_irq);
+  return 0;
+}
+
+/* Hand the data still short of a full slot to the consumer as a partial
+ * slot: what has already been drained into the current slot. Kernel drain
+ * mode only; the AxIO DMA engine cannot report how far the transfer in
+ * flight got, so there is nothing to publish there. Any context.
+ */
+int apci_dma_flush(struct apci_my_info *ddata)
+{
+  unsigned long flags;
+  bool completed = false;
+  int status = 0;
+
+  /* checked under the lock: the flush timer can race the ring being freed */
+  spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+  if (ddata->dma_slot_meta == NULL)
+  {
+    status = -ENODEV;
+  }
+  else if (READ_ONCE(ddata->fifo_drain_words))
+  {
+    if (ddata->fifo_fill)
+      completed = apci_fifo_complete_locked(ddata, ddata->fifo_fill);
+  }
+  else
+  {
+    status = -EOPNOTSUPP;
+  }
+  spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+  if (completed)
+    wake_up_interruptible(&(ddata->dma_wait_queue));
+  return status;
+}
+
+/* Flush whenever no slot has completed for dma_flush_timeout_ns. */
+static enum hrtimer_restart apci_dma_flush_timer_fn(struct hrtimer *timer)
+{
+  struct apci_my_info *ddata = container_of(timer, struct apci_my_info, dma_flush_timer);
+  u64 timeout = READ_ONCE(ddata->dma_flush_timeout_ns);
+
+  if (timeout == 0)
+    return HRTIMER_NORESTART;
+  if (ktime_get_ns() - READ_ONCE(ddata->dma_last_complete_ns) >= timeout)
+    apci_dma_flush(ddata);
+
+  hrtimer_forward_now(timer, ns_to_ktime(timeout));
+  return HRTIMER_RESTART;
+}
+
+int apci_dma_set_flush_timeout(struct apci_my_info *ddata, unsigned long ms)
+{
+  if (!apci_fifo_drain_capable(ddata))
+    return -EOPNOTSUPP;
+
+  hrtimer_cancel(&ddata->dma_flush_timer);
+  WRITE_ONCE(ddata->dma_flush_timeout_ns, (u64)ms * NSEC_PER_MSEC);
+  if (ms)
+  {
+    WRITE_ONCE(ddata->dma_last_complete_ns, ktime_get_ns());
+    hrtimer_start(&ddata->dma_flush_timer, ns_to_ktime(ddata->dma_flush_timeout_ns), HRTIMER_MODE_REL);
+  }
+  return 0;
+}
+
+enum apci_debounce_family { DEBOUNCE_NONE = 0, DEBOUNCE_IIRO, DEBOUNCE_MPCIE_II };
+
+static enum apci_debounce_family apci_debounce_family(struct apci_my_info *ddata)
+{
+  switch (ddata->dev_id)
+  {
+  case PCIe_IIRO_8:
+  case PCIe_IIRO_16:
+  case PCI_IIRO_8:
+  case PCI_IIRO_16:
+  case LPCI_IIRO_8:
+    return DEBOUNCE_IIRO;
+  case MPCIE_II_16:
+  case MPCIE_II_8:
+  case MPCIE_II_4:
+    return DEBOUNCE_MPCIE_II;
+  default:
+    return DEBOUNCE_NONE;
+  }
+}
+
+static __u32 apci_debounce_sample(struct apci_my_info *ddata)
+{
+  __u32 state = 0;
+
+  switch (apci_debounce_family(ddata))
+  {
+  case DEBOUNCE_IIRO:
+    state = inb(ddata->regions[2].start + 0x1);
+    if (ddata->dev_id == PCIe_IIRO_16 || ddata->dev_id == PCI_IIRO_16)
+      state |= inb(ddata->regions[2].start + 0x5) << 8;
+    break;
+  case DEBOUNCE_MPCIE_II:
+    state = inb(ddata->regions[2].start + 0x0);
+    if (ddata->dev_id == MPCIE_II_16)
+      state |= inb(ddata->regions[2].start + 0x1) << 8;
+    break;
+  default:
+    break;
+  }
+  return state;
+}
+
+static void apci_debounce_mask(struct apci_my_info *ddata)
+{
+  switch (apci_debounce_family(ddata))
+  {
+  case DEBOUNCE_IIRO:
+    outb(0, ddata->regions[2].start + 0x2); /* write disables CoS IRQ */
+    break;
+  case DEBOUNCE_MPCIE_II:
+    outb(0, ddata->regions[2].start + 40);
+    break;
+  default:
+    break;
+  }
+}
+
+static void apci_debounce_unmask(struct apci_my_info *ddata)
+{
+  switch (apci_debounce_family(ddata))
+  {
+  case DEBOUNCE_IIRO:
+    outb(0, ddata->regions[2].start + 0x1); /* drop edges latched while masked */
+    inb(ddata->regions[2].start + 0x2); /* read enables CoS IRQ */
+    break;
+  case DEBOUNCE_MPCIE_II:
+    outb(0xff, ddata->regions[2].start + 41);
+    outb(READ_ONCE(ddata->debounce_cos_mask), ddata->regions[2].start + 40);
+    break;
+  default:
+    break;
+  }
+}
+
+/* A CoS edge arrived while debouncing: open a window on the first one.
+ * Returns false, the event is delivered (or not) by the timer.
+ * debounce_stats is under irq_lock.
+ */
+static bool apci_debounce_edge(struct apci_my_info *ddata)
+{
+  spin_lock(&(ddata->irq_lock));
+  ddata->debounce_stats.edges++;
+  spin_unlock(&(ddata->irq_lock));
+  if (!hrtimer_is_queued(&ddata->debounce_timer))
+  {
+    apci_debounce_mask(ddata);
+    hrtimer_start(&ddata->debounce_timer, ns_to_ktime(ddata->debounce_ns), HRTIMER_MODE_REL);
+  }
+  return false;
+}
+
+static enum hrtimer_restart apci_debounce_timer_fn(struct hrtimer *timer)
+{
+  struct apci_my_info *ddata = container_of(timer, struct apci_my_info, debounce_timer);
+  __u32 state;
+  bool changed;
+
+  apci_debounce_unmask(ddata);
+  state = apci_debounce_sample(ddata);
+  spin_lock(&(ddata->irq_lock));
+  changed = state != ddata->debounce_stats.state;
+  if (changed)
+  {
+    ddata->debounce_stats.state = state;
+    ddata->debounce_stats.events++;
+  }
+  else
+  {
+    ddata->debounce_stats.suppressed++;
+  }
+  spin_unlock(&(ddata->irq_lock));
+
+  if (changed)
+    apci_event_deliver(ddata, state, false);
+  return HRTIMER_NORESTART;
+}
+
+/* Set the debounce window; 0 turns debouncing off. Process context only. */
+int apci_set_debounce_window(struct apci_my_info *ddata, unsigned long usecs)
+{
+  unsigned long flags;
+  __u32 state;
+
+  if (apci_debounce_family(ddata) == DEBOUNCE_NONE)
+    return -EOPNOTSUPP;
+
+  WRITE_ONCE(ddata->debounce_ns, 0);
+  if (hrtimer_cancel(&ddata->debounce_timer))
+    apci_debounce_unmask(ddata);
+
+  state = apci_debounce_sample(ddata);
+  spin_lock_irqsave(&(ddata->irq_lock), flags);
+  ddata->debounce_stats.state = state;
+  spin_unlock_irqrestore(&(ddata->irq_lock), flags);
+  WRITE_ONCE(ddata->debounce_ns, (u64)usecs * NSEC_PER_USEC);
+  return 0;
+}
+
+/* Track what the user writes to IRQ enable registers, so the driver
+ * restores their latest configuration when it re-arms or unmasks, and to
+ * the AxIO divisor for dma_latency_t.
+ */
+void apci_snoop_write(struct apci_my_info *ddata, int bar, unsigned int offset, enum SIZE size, __u32 data)
+{
+  if (bar == 1 && offset == mPCIe_ADIO_DivisorOffset && size == DWORD && apci_is_axio(ddata))
+    apci_dma_retune(ddata, data);
+
+  if (bar != 2)
+    return;
+
+  switch (apci_rearm_family(ddata))
+  {
+  case REARM_DIO:
+    if (offset == 0x1e && size == WORD)
+    {
+      WRITE_ONCE(ddata->rearm_mask[0], data & 0xff);
+      WRITE_ONCE(ddata->rearm_mask[1], (data >> 8) & 0xff);
+    }
+    else if ((offset == 0x1e || offset == 0x1f) && size == BYTE)
+    {
+      WRITE_ONCE(ddata->rearm_mask[offset - 0x1e], data & 0xff);
+    }
+    break;
+  case REARM_AI12:
+    if (offset == 0x4 && size == BYTE)
+      WRITE_ONCE(ddata->rearm_mask[0], data & 0xff);
+    break;
+  default:
+    break;
+  }
+
+  if (apci_debounce_family(ddata) == DEBOUNCE_MPCIE_II && offset == 40 && size == BYTE)
+    WRITE_ONCE(ddata->debounce_cos_mask, data & 0xff);
+
+  if (offset / 8 < apci_quad_channels(ddata) && offset % 8 == 6 && size == BYTE &&
+      (data & QUAD_CMD_RESET_COUNTER))
+    apci_quad_reset(ddata, offset / 8);
+}
+
+/* Register access for action programs; the address was validated when
+ * the rule was set.
+ */
+static __u32 apci_action_read(struct apci_my_info *ddata, int bar, __u32 offset, int size)
+{
+  io_region *region = &ddata->regions[bar];
+
+  if (region->flags & IORESOURCE_IO)
+  {
+    switch (size)
+    {
+    case BYTE: return inb(region->start + offset);
+    case WORD: return inw(region->start + offset);
+    default: return inl(region->start + offset);
+    }
+  }
+  switch (size)
+  {
+  case BYTE: return ioread8(region->mapped_address + offset);
+  case WORD: return ioread16(region->mapped_address + offset);
+  default: return ioread32(region->mapped_address + offset);
+  }
+}
+
+static void apci_action_write(struct apci_my_info *ddata, int bar, __u32 offset, int size, __u32 data)
+{
+  io_region *region = &ddata->regions[bar];
+
+  apci_snoop_write(ddata, bar, offset, size, data);
+  if (region->flags & IORESOURCE_IO)
+  {
+    switch (size)
+    {
+    case BYTE: outb(data, region->start + offset); break;
+    case WORD: outw(data, region->start + offset); break;
+    default: outl(data, region->start + offset); break;
+    }
+    return;
+  }
+  switch (size)
+  {
+  case BYTE: iowrite8(data, region->mapped_address + offset); break;
+  case WORD: iowrite16(data, region->mapped_address + offset); break;
+  default: iowrite32(data, region->mapped_address + offset); break;
+  }
+}
+
+/* Run one rule's program and log it. Caller holds action_lock. */
+static void apci_action_run(struct apci_my_info *ddata, int index, __u32 status, u64 irq_ns)
+{
+  const action_rule_t *rule = &ddata->actions[index];
+  action_log_t *log = ddata->action_log;
+  action_log_entry_t *entry = &log->entries[log->head % APCI_ACTION_LOG_ENTRIES];
+  const action_op_t *op;
+  __u32 value;
+  int i;
+
+  memset(entry, 0, sizeof(*entry));
+  for (i = 0; i < APCI_ACTION_OPS; i++)
+  {
+    op = &rule->ops[i];
+    switch (op->opcode)
+    {
+    case APCI_ACTION_WRITE:
+      apci_action_write(ddata, op->bar, op->offset, op->size, op->value);
+      continue;
+    case APCI_ACTION_MODIFY:
+      value = apci_action_read(ddata, op->bar, op->offset, op->size);
+      entry->reads[i] = value;
+      apci_action_write(ddata, op->bar, op->offset, op->size, (value & ~op->mask) | (op->value & op->mask));
+      continue;
+    case APCI_ACTION_READ:
+      entry->reads[i] = apci_action_read(ddata, op->bar, op->offset, op->size);
+      continue;
+    default:
+      break;
+    }
+    break;
+  }
+
+  entry->done_ns = ktime_get_ns();
+  entry->irq_ns = irq_ns;
+  entry->rule = index;
+  entry->status = status;
+  smp_wmb();
+  WRITE_ONCE(log->head, log->head + 1);
+}
+
+static void apci_actions_run(struct apci_my_info *ddata)
+{
+  __u32 status;
+  __u32 value;
+  u64 irq_ns;
+  int i;
+
+  if (!atomic_xchg(&ddata->action_pending, 0))
+    return;
+  status = atomic_xchg(&ddata->action_status, 0);
+  irq_ns = READ_ONCE(ddata->action_irq_ns);
+
+  mutex_lock(&ddata->action_lock);
+  for (i = 0; i < APCI_ACTION_RULES; i++)
+  {
+    const action_rule_t *rule = &ddata->actions[i];
+
+    if (!rule->enable)
+      continue;
+    if (rule->source == APCI_ACTION_SRC_REGISTER)
+      value = apci_action_read(ddata, rule->bar, rule->offset, rule->size);
+    else
+      value = status;
+    if ((value & rule->mask) == rule->match)
+      apci_action_run(ddata, i, value, irq_ns);
+  }
+  mutex_unlock(&ddata->action_lock);
+}
+
+/* Install, replace or (enable = 0) remove a rule. The caller validated its
+ * register addresses. Process context only.
+ */
+int apci_set_action_rule(struct apci_my_info *ddata, const action_rule_t *rule)
+{
+  action_log_t *log;
+  int count;
+
+  if (!ddata->irq_capable)
+    return -EOPNOTSUPP;
+  if (rule->index >= APCI_ACTION_RULES)
+    return -EINVAL;
+
+  mutex_lock(&ddata->action_lock);
+  if (rule->enable && ddata->action_log == NULL)
+  {
+    log = (action_log_t *)get_zeroed_page(GFP_KERNEL);
+    if (log == NULL)
+    {
+      mutex_unlock(&ddata->action_lock);
+      return -ENOMEM;
+    }
+    ddata->action_log = log;
+  }
+
+  count = ddata->action_count - !!ddata->actions[rule->index].enable + !!rule->enable;
+  ddata->actions[rule->index] = *rule;
+  WRITE_ONCE(ddata->action_count, count);
+  mutex_unlock(&ddata->action_lock);
+  return 0;
+}
+
+/* Threaded half of the IRQ: run the user's action rules, then restore the
+ * enables the ISR cleared, now that the event has been queued for the user.
+ */
+irqreturn_t apci_irq_thread(int irq, void *dev_id)
+{
+  struct apci_my_info *ddata = (struct apci_my_info *)dev_id;
+
+  apci_actions_run(ddata);
+
+  /* action rules wake us too: only re-arm when the user asked for it */
+  if (!READ_ONCE(ddata->rearm))
+    return IRQ_HANDLED;
+
+  switch (apci_rearm_family(ddata))
+  {
+  case REARM_DIO:
+    outb(READ_ONCE(ddata->rearm_mask[0]), ddata->regions[2].start + 0x1e);
+    outb(READ_ONCE(ddata->rearm_mask[1]), ddata->regions[2].start + 0x1f);
+    break;
+  case REARM_AI12:
+    outb(READ_ONCE(ddata->rearm_mask[0]), ddata->regions[2].start + 0x4);
+    break;
+  default:
+    break;
+  }
+  return IRQ_HANDLED;
+}
+
+irqreturn_t apci_interrupt(int irq, void *dev_id)
+{
+  struct apci_my_info *ddata;
+  __u8 byte;
+  __u32 dword;
+  bool notify_user = true;
+  uint32_t irq_event = 0;
+  __u32 rate;
+
+  ddata = (struct apci_my_info *)dev_id;
+  switch (ddata->dev_id)
+  {
+  case PCIe_ADIO16_16FDS:
+  case PCIe_ADIO16_16F:
+  case PCIe_ADIO16_16A:
+  case PCIe_ADIO16_16E:
+  case PCIe_ADI16_16F:
+  case PCIe_ADI16_16A:
+  case PCIe_ADI16_16E:
+  case PCIe_ADIO12_16A:
+  case PCIe_ADIO12_16:
+  case PCIe_ADIO12_16E:
+  case PCIe_ADI12_16A:
+  case PCIe_ADI12_16:
+  case PCIe_ADI12_16E:
+  case mPCIe_AIO16_16FDS:
+  case mPCIe_AIO16_16F:
+  case mPCIe_AIO16_16A:
+  case mPCIe_AIO16_16E:
+  case mPCIe_AI16_16F:
+  case mPCIe_AI16_16A:
+  case mPCIe_AI16_16E:
+  case mPCIe_AIO12_16A:
+  case mPCIe_AIO12_16:
+  case mPCIe_AIO12_16E:
+  case mPCIe_AI12_16A:
+  case mPCIe_AI12_16:
+  case mPCIe_AI12_16E:
+  case mPCIe_ADIO16_8FDS:
+  case mPCIe_ADIO16_8F:
+  case mPCIe_ADIO16_8A:
+  case mPCIe_ADIO16_8E:
+  case mPCIe_ADI16_8F:
+  case mPCIe_ADI16_8A:
+  case mPCIe_ADI16_8E:
+  case mPCIe_ADIO12_8A:
+  case mPCIe_ADIO12_8:
+  case mPCIe_ADIO12_8E:
+  case mPCIe_ADI12_8A:
+  case mPCIe_ADI12_8:
+  case mPCIe_ADI12_8E:
+    break;
+
+  default:
+    /* The first thing we do is check to see if the card is causing an IRQ.
+     * If it is then we can proceed to clear the IRQ. Otherwise let
+     * Linux know that it wasn't us.
+     */
+    if (!ddata->is_pcie)
+    {
+      byte = inb(ddata->plx_region.start + 0x4C);
+
+      if ((byte & 4) == 0)
+      {
+        return IRQ_NONE; /* not me */
+      }
+    }
+    else
+    { /* PCIe */
+      if (ddata->plx_region.flags & IORESOURCE_IO)
+      {
+        byte = inb(ddata->plx_region.start + 0x69);
+      }
+      else
+      {
+        byte = ioread8(ddata->plx_region.mapped_address + 0x69);
+      }
+
+      if ((byte & 0x80) == 0)
+      {
+        return IRQ_NONE; /* not me */
+      }
+    }
+  } // handle 9052 & 8311 "IAm" IRQ Flags
+
+  apci_devel("ISR called.\n");
+
+  /* Handle interrupt based on the device ID for the board. */
+  switch (ddata->dev_id)
+  {
+  case PCIe_DIO_24:
+  case PCIe_DIO_24D:
+  case PCIe_DIO_24S:
+  case PCIe_DIO_24DS:
+  case PCIe_DIO_24DC:
+  case PCIe_DIO_24DCS:
+  case PCIe_DIO_48:
+  case PCIe_DIO_48S:
+  case PCI_DIO_24H:
+  case PCI_DIO_24D:
+  case PCI_DIO_24H_C:
+  case PCI_DIO_24D_C:
+  case PCI_DIO_24S:
+  case PCI_DIO_48:
+  case PCI_DIO_48S:
+  case MPCIE_DIO_24:
+  case MPCIE_DIO_24S:
+  case MPCIE_DIO_24S_R1:
+    outb(0, ddata->regions[2].start + 0x0f);
+    break;
+
+    /* These cards don't have the IRQ simply "Cleared",
+     * it must be disabled then re-enabled (by the user, or by
+     * apci_irq_thread when the re-arm policy is enabled).
+     */
+  case PCI_DIO_72:
+  case PCI_DIO_96:
+  case PCI_DIO_96CT:
+  case PCI_DIO_96C3:
+  case PCI_DIO_120:
+  case PCIe_DIO_72:
+  case PCIe_DIO_96:
+  case PCIe_DIO_120:
+    outb(0, ddata->regions[2].start + 0x1e);
+    outb(0, ddata->regions[2].start + 0x1f);
+    break;
+
+  case PCI_DA12_16:
+  case PCI_DA12_8:
+  case PCIe_DA16_16:
+  case PCIe_DA16_8:
+  case PCIe_DA12_16:
+  case PCIe_DA12_8:
+    byte = inb(ddata->regions[2].start + 0xC);
+    break;
+
+  case PCI_WDG_CSM:
+    outb(0, ddata->regions[2].start + 0x9);
+    outb(0, ddata->regions[2].start + 0x4);
+    apci_wdt_irq(ddata);
+    break;
+
+  case PCIe_IIRO_8:
+  case PCIe_IIRO_16:
+  case PCI_IIRO_8:
+  case PCI_IIRO_16:
+  case PCI_IDIO_16:
+  case LPCI_IIRO_8:
+    apci_devel("Interrupt for PCIe_IIRO_8");
+    outb(0, ddata->regions[2].start + 0x1);
+    if (READ_ONCE(ddata->debounce_ns) && apci_debounce_family(ddata) != DEBOUNCE_NONE)
+      notify_user = apci_debounce_edge(ddata);
+    break;
+
+  case PCI_IDI_48:
+    byte = inb(ddata->regions[2].start + 0x7);
+    break;
+
+  case PCI_AI12_16:
+  case PCI_AI12_16_:
+  case PCI_AI12_16A:
+  case PCI_AIO12_16:
+  case PCI_A12_16A:
+    /* Clear the FIFO interrupt enable bits, but leave
+     * the counter enabled.  Otherwise the IRQ will not
+     * go away and user code will never run as the machine
+     * will hang in a never-ending IRQ loop. The userland
+     * irq routine must re-enable the interrupts if desired,
+     * unless the re-arm policy has apci_irq_thread do it.
+     */
+    outb(0x01, ddata->regions[2].start + 0x4);
+    byte = inb(ddata->regions[2].start + 0x4);
+    if (READ_ONCE(ddata->fifo_drain_words))
+    {
+      /* drain in the driver and give the user back their enables */
+      notify_user = apci_fifo_drain(ddata);
+      outb(READ_ONCE(ddata->rearm_mask[0]), ddata->regions[2].start + 0x4);
+    }
+    break;
+
+  case LPCI_A16_16A:
+    outb(0, ddata->regions[2].start + 0xc);
+    if (READ_ONCE(ddata->fifo_drain_words))
+      notify_user = apci_fifo_drain(ddata);
+    outb(0x10, ddata->regions[2].start + 0xc);
+    break;
+
+  case P104_DIO_96:  /* unknown at this time 6-FEB-2007 */
+  case P104_DIO_48S: /* unknown at this time 6-FEB-2007 */
+    break;
+  case MPCIE_IDIO_8:
+  case MPCIE_IIRO_8:
+  case MPCIE_IDIO_4:
+  case MPCIE_IIRO_4:
+  case MPCIE_IDO_8:
+  case MPCIE_RO_8:
+  case MPCIE_II_16:
+  case MPCIE_II_8:
+  case MPCIE_II_4:
+    outb(0xff, ddata->regions[2].start + 41);
+    if (READ_ONCE(ddata->debounce_ns) && apci_debounce_family(ddata) != DEBOUNCE_NONE)
+      notify_user = apci_debounce_edge(ddata);
+    break;
+
+  case MPCIE_QUAD_4:
+  case PCI_QUAD_4:
+    {
+      int i;
+      for (i = 0; i < 4; i++)
+      {
+        byte = inb(ddata->regions[2].start + 0x8 * i + 7);
+        if (0 ==( byte & 0x80))
+          break;
+
+        if (byte & 0x08)
+        {
+          outb(0x08, ddata->regions[2].start + 0x8 * i + 6);
+          /* carry/borrow: fold the wrap in before the next one */
+          apci_quad_fold(ddata, i, 1, (byte & QUAD_FLAG_UP) ? 1 : -1);
+        }
+      }
+    }
+    break;
+
+  case MPCIE_QUAD_8:
+  case PCI_QUAD_8:
+    {
+      int i;
+      for (i = 0; i < 8; i++)
+      {
+        byte = inb(ddata->regions[2].start + 0x8 * i + 7);
+        if (0 == (byte & 0x80))
+          break;
+
+        if (byte & 0x08)
+        {
+          outb(0x08, ddata->regions[2].start + 0x8 * i + 6);
+          /* carry/borrow: fold the wrap in before the next one */
+          apci_quad_fold(ddata, i, 1, (byte & QUAD_FLAG_UP) ? 1 : -1);
+        }
+      }
+    }
+    break;
+
+  case PCIe_IDIO_12:
+  case PCIe_IDIO_24:
+    /* read 32 bits from +8 to determine which specific bits have generated a CoS IRQ then write the same value back to +8 to clear those CoS latches */
+    dword = inl(ddata->regions[2].start + 0x8);
+    outl(dword, ddata->regions[2].start + 0x8);
+    irq_event = dword;
+    apci_edges_update(ddata, dword);
+    break;
+
+  case mPCIe_AIO16_16F_proto:
+  case mPCIe_AIO16_16A_proto:
+  case mPCIe_AIO16_16E_proto:
+  case mPCIe_AI16_16F_proto:
+  case mPCIe_AI16_16A_proto:
+  case mPCIe_AI16_16E_proto:
+  case mPCIe_AIO12_16A_proto:
+  case mPCIe_AIO12_16_proto:
+  case mPCIe_AIO12_16E_proto:
+  case mPCIe_AI12_16A_proto:
+  case mPCIe_AI12_16_proto:
+  case mPCIe_AI12_16E_proto: // DMA capable cards
+  {
+    apci_devel("ISR: mPCIe-AI irq_event\n");
+    // If this is a FIFO near full IRQ then tell the card
+    // to write to the next buffer (and don't notify the user?)
+    // else if it is a write done IRQ set last_valid_buffer and notify user
+    irq_event = ioread8(ddata->regions[2].mapped_address + 0x2);
+    if (irq_event == 0)
+    {
+      apci_devel("ISR: not our IRQ\n");
+      return IRQ_NONE;
+    }
+
+    if (irq_event & 0x1) // FIFO almost full
     {
-      dma_addr_t base = ddata->dma_addr;
+      dma_addr_t base;
+      bool dropped = false;
       spin_lock(&(ddata->dma_data_lock));
+      if (ddata->dma_slot_meta == NULL)
+      {
+        /* no ring, or it is being freed */
+        spin_unlock(&(ddata->dma_data_lock));
+        notify_user = false;
+        goto ai_ack;
+      }
+      apci_ring_sync_locked(ddata);
       if (ddata->dma_last_buffer == -1)
       {
         notify_user = false;
@@ -1573,23 +3440,22 @@ irqreturn_t apci_interrupt(int irq, void *dev_id)
       ddata->dma_last_buffer %= ddata->dma_num_slots;
 
       if (ddata->dma_last_buffer == ddata->dma_first_valid)
+        dropped = apci_ring_full_locked(ddata);
+      if (!dropped && notify_user)
       {
-        apci_error("ISR: data discarded");
-        ddata->dma_last_buffer--;
-        if (ddata->dma_last_buffer < 0)
-          ddata->dma_last_buffer = ddata->dma_num_slots - 1;
-        ddata->dma_data_discarded++;
+        apci_ring_produce_locked(ddata, ioread32(ddata->regions[2].mapped_address + 0x28), ddata->dma_slot_size);
       }
-      spin_unlock(&(ddata->dma_data_lock));
-      base += ddata->dma_slot_size * ddata->dma_last_buffer;
+      base = apci_dma_slot_for_device(ddata, ddata->dma_last_buffer);
 
       iowrite32(base & 0xffffffff, ddata->regions[0].mapped_address);
       iowrite32(base >> 32, ddata->regions[0].mapped_address + 4);
       iowrite32(ddata->dma_slot_size, ddata->regions[0].mapped_address + 8);
       iowrite32(4, ddata->regions[0].mapped_address + 12);
+      spin_unlock(&(ddata->dma_data_lock));
       udelay(5);
     }
 
+ai_ack:
     iowrite8(irq_event, ddata->regions[2].mapped_address + 0x2);
     apci_debug("ISR: irq_event = 0x%x, depth = 0x%x\n", irq_event, ioread32(ddata->regions[2].mapped_address + 0x28));
     break;
@@ -1636,9 +3502,12 @@ irqreturn_t apci_interrupt(int irq, void *dev_id)
   case mPCIe_ADI12_8E:
   {
     apci_devel("ISR: mPCIe-AxIO irq_event\n");
-    // If this is a FIFO near full IRQ then tell the card
-    // to write to the next buffer (and don't notify the user)
-    // else if it is a write done IRQ set last_valid_buffer and notify user
+    if (READ_ONCE(ddata->poll_mode))
+    {
+      /* The card's IRQ sources are masked and poll_timer services them. */
+      return IRQ_NONE;
+    }
+
     irq_event = ioread32(ddata->regions[1].mapped_address + mPCIe_ADIO_IRQStatusAndClearOffset); // TODO: Upgrade to doRegisterAction("AmI?")
 
     if ((irq_event & mPCIe_ADIO_IRQEventMask) == 0)
@@ -1647,43 +3516,15 @@ irqreturn_t apci_interrupt(int irq, void *dev_id)
       return IRQ_NONE;
     }
 
-    if (irq_event & (bmADIO_ADCTRIGGERStatus | bmADIO_DMADoneStatus))
-    {
-      dma_addr_t base = ddata->dma_addr;
-      spin_lock(&(ddata->dma_data_lock));
-      if (ddata->dma_last_buffer == -1)
-      {
-        notify_user = false;
-        apci_debug("ISR First IRQ");
-      }
-      else if (ddata->dma_first_valid == -1)
-      {
-        ddata->dma_first_valid = 0;
-      }
-
-      ddata->dma_last_buffer++;
-      ddata->dma_last_buffer %= ddata->dma_num_slots;
-
-      if (ddata->dma_last_buffer == ddata->dma_first_valid)
-      {
-        apci_error("ISR: data discarded");
-        ddata->dma_last_buffer--;
-        if (ddata->dma_last_buffer < 0)
-          ddata->dma_last_buffer = ddata->dma_num_slots - 1;
-        ddata->dma_data_discarded++;
-      }
-      spin_unlock(&(ddata->dma_data_lock));
-      base += ddata->dma_slot_size * ddata->dma_last_buffer;
+    notify_user = apci_axio_service(ddata, irq_event);
+    ddata->irq_events++;
 
-      iowrite32(base & 0xffffffff, ddata->regions[0].mapped_address + 0x10);
-      iowrite32(base >> 32, ddata->regions[0].mapped_address + 4 + 0x10);
-      iowrite32(ddata->dma_slot_size, ddata->regions[0].mapped_address + 8 + 0x10);
-      iowrite32(4, ddata->regions[0].mapped_address + 12 + 0x10);
-      udelay(5); // ?
+    if (ddata->poll_enter_rate &&
+        apci_rate_account(ddata, 1, &rate) &&
+        rate > ddata->poll_enter_rate)
+    {
+      apci_poll_start(ddata, irq_event, rate);
     }
-
-    iowrite32(irq_event, ddata->regions[1].mapped_address + mPCIe_ADIO_IRQStatusAndClearOffset); // clear whatever IRQ occurred and retain enabled IRQ sources // TODO: Upgrade to doRegisterAction("Clear&Enable")
-    apci_debug("ISR: irq_event = 0x%x, depth = 0x%x, IRQStatus = 0x%x\n", irq_event, ioread32(ddata->regions[1].mapped_address + 0x28), ioread32(ddata->regions[1].mapped_address + 0x40));
     break;
   }
   }; // end card-specific switch
@@ -1694,24 +3535,46 @@ irqreturn_t apci_interrupt(int irq, void *dev_id)
    * the critical data to interrupt us so we won't disable other IRQs.
    */
   if (notify_user)
-  {
-    spin_lock(&(ddata->irq_lock));
-
-    if (ddata->waiting_for_irq)
-    {
-      ddata->waiting_for_irq = 0;
-      spin_unlock(&(ddata->irq_lock));
-      wake_up_interruptible(&(ddata->wait_queue));
-    }
-    else
-    {
-      spin_unlock(&(ddata->irq_lock));
-    }
-  }
+    apci_event_deliver(ddata, irq_event, true);
   apci_devel("ISR: IRQ Handled\n");
+
+  if (atomic_read(&ddata->action_pending) ||
+      (READ_ONCE(ddata->rearm) && apci_rearm_family(ddata) != REARM_NONE))
+    return IRQ_WAKE_THREAD;
   return IRQ_HANDLED;
 }
 
+/* Steer the card's IRQ to one CPU, or drop the hint when cpu < 0. */
+int apci_set_irq_affinity_cpu(struct apci_my_info *ddata, int cpu)
+{
+  const struct cpumask *mask = NULL;
+  int ret;
+
+  if (!ddata->irq_capable)
+    return -EOPNOTSUPP;
+
+  if (cpu >= 0)
+  {
+    if (cpu >= nr_cpu_ids || !cpu_online(cpu))
+      return -EINVAL;
+    cpumask_clear(&ddata->irq_affinity_mask);
+    cpumask_set_cpu(cpu, &ddata->irq_affinity_mask);
+    mask = &ddata->irq_affinity_mask;
+  }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+  ret = irq_set_affinity_and_hint(ddata->irq, mask);
+#else
+  ret = irq_set_affinity_hint(ddata->irq, mask);
+#endif
+  if (ret)
+    return ret;
+
+  ddata->irq_affinity_cpu = (cpu >= 0) ? cpu : -1;
+  apci_debug("irq %d affinity cpu %d\n", ddata->irq, ddata->irq_affinity_cpu);
+  return 0;
+}
+
 void remove(struct pci_dev *pdev)
 {
   struct apci_my_info *ddata = pci_get_drvdata(pdev);
@@ -1719,6 +3582,11 @@ void remove(struct pci_dev *pdev)
   struct apci_my_info *_temp;
   apci_devel("entering remove\n");
 
+  apci_wdt_unregister(ddata);
+
+  if (ddata->irq_affinity_cpu >= 0)
+    apci_set_irq_affinity_cpu(ddata, -1);
+
   spin_lock(&(ddata->irq_lock));
 
   if (ddata->irq_capable)
@@ -1726,13 +3594,20 @@ void remove(struct pci_dev *pdev)
 
   spin_unlock(&(ddata->irq_lock));
 
-  if (ddata->dma_virt_addr != NULL)
-  {
-    dma_free_coherent(&(ddata->pci_dev->dev),
-                      ddata->dma_num_slots * ddata->dma_slot_size,
-                      ddata->dma_virt_addr,
-                      ddata->dma_addr);
-  }
+  /* Only now that the ISR cannot re-arm them. The poll timer goes first,
+   * it queues level work.
+   */
+  hrtimer_cancel(&ddata->poll_timer);
+  apci_level_reset(ddata);
+  hrtimer_cancel(&ddata->quad_timer);
+  hrtimer_cancel(&ddata->debounce_timer);
+  hrtimer_cancel(&ddata->dma_flush_timer);
+  /* last: the ISR, level work and debounce timer all restart it */
+  hrtimer_cancel(&ddata->coalesce_timer);
+  /* importers keep what they hold; the rest is freed here */
+  apci_dmabuf_detach(ddata);
+  apci_dma_free_ring(ddata);
+  apci_dma_free_prealloc(ddata);
 
   apci_class_dev_unregister(ddata);
 
@@ -1783,14 +3658,17 @@ int probe(struct pci_dev *pdev, const struct pci_device_id *id)
   ddata->is_pcie = (ddata->plx_region.length >= 0x100 ? 1 : 0);
   apci_debug("Is device PCIE : %d\n", ddata->is_pcie);
 
+  apci_dma_setup(ddata);
+
   /* Spin lock init stuff */
 
   /* Request Irq */
   if (ddata->irq_capable)
   {
     apci_debug("Requesting Interrupt, %u\n", (unsigned int)ddata->irq);
-    ret = request_irq((unsigned int)ddata->irq,
+    ret = request_threaded_irq((unsigned int)ddata->irq,
                       apci_interrupt,
+                      apci_irq_thread,
                       IRQF_SHARED,
                       "apci",
                       ddata);
@@ -1830,6 +3708,7 @@ int probe(struct pci_dev *pdev, const struct pci_device_id *id)
     /*      goto exit_free; */
     /* } else { */
     init_waitqueue_head(&(ddata->wait_queue));
+    init_waitqueue_head(&(ddata->dma_wait_queue));
     /* } */
   }
 
@@ -1856,6 +3735,10 @@ int probe(struct pci_dev *pdev, const struct pci_device_id *id)
   if (ret)
     goto exit_pci_setdrv;
 
+  /* /dev/apci keeps working without the watchdog core */
+  if (apci_wdt_register(ddata))
+    apci_error("could not register watchdog device\n");
+
   apci_debug("Added driver %d\n", dev_counter - 1);
   apci_debug("Value of irq is %d\n", pdev->irq);
   return 0;
@@ -1878,6 +3761,7 @@ exit_irq:
   if (ddata->irq_capable)
     free_irq(pdev->irq, ddata);
 exit_free:
+  apci_dma_free_prealloc(ddata);
   apci_free_driver(pdev);
   return ret;
 }
@@ -3,24 +3,32 @@
 
 
 #include <linux/cdev.h>
+#include <linux/cpumask.h>
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
 #include <linux/idr.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
 #include <linux/ioctl.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/pci.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/sysfs.h>
 #include <linux/types.h>
 #include <asm/uaccess.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
+#include <linux/watchdog.h>
 
 #include "apci_common.h"
+#include "apci_ioctl.h"
 
 
 /* The device IDs for all the PCI/PCIe/mPCIe/etc cards this driver will support. */
@@ -333,6 +341,7 @@ struct apci_my_info {
      spinlock_t driver_list_lock;
 
      wait_queue_head_t wait_queue;
+     wait_queue_head_t dma_wait_queue; /* apci_wait_for_data sleepers */
      spinlock_t irq_lock;
 
 
@@ -353,11 +362,214 @@ struct apci_my_info {
      int dma_num_slots;
      size_t dma_slot_size;
      int dma_data_discarded;
+     __u32 dma_discarded_total;
      spinlock_t dma_data_lock;
 
      void *dac_fifo_buffer;
+     size_t dac_fifo_size;
+     struct apci_dmabuf *dac_export; /* see apci_dmabuf.c */
+
+     /* Adaptive IRQ/polling (AxIO only). poll_enter_rate == 0 disables it. */
+     int poll_mode; /* 0 = card IRQ enabled, 1 = card IRQ masked, poll_timer services it */
+     __u32 poll_enter_rate; /* events/s above which we switch to polling */
+     __u32 poll_exit_rate; /* events/s below which we switch back to IRQs */
+     u64 poll_interval_ns;
+     __u32 poll_irq_enables; /* IRQ enables to restore when leaving polling */
+     struct hrtimer poll_timer;
+     u64 rate_window_start;
+     __u32 rate_window_events;
+     __u32 event_rate; /* events/s measured over the last complete window */
+     u64 poll_mode_switches;
+     u64 irq_events;
+     u64 polled_events;
+
+     status_page_t *status_page; /* mmap-able, see APCI_MMAP_STATUS */
+     /* Ring preallocated at probe (dma_prealloc_kb), carved up by
+      * apci_set_dma_transfer_size instead of allocating */
+     void *dma_prealloc_virt;
+     dma_addr_t dma_prealloc_addr;
+     size_t dma_prealloc_size;
+
+     /* Cached ring from dma_alloc_pages, see apci_set_dma_ring_mode */
+     int dma_noncoherent; /* mode for the next apci_set_dma_transfer_size */
+     struct page *dma_pages;
+     struct apci_dmabuf *dma_export; /* see apci_dmabuf.c */
+
+     /* User-buffer ring, see dma_user_buffer_t; dma_virt_addr then points
+      * into a vmap of the pinned pages */
+     struct page **dma_user_pages;
+     unsigned long dma_user_npages;
+     dma_addr_t *dma_user_slots; /* bus address of each slot */
+     void *dma_user_vmap;
+
+     slot_meta_t *dma_slot_meta; /* one per slot, mmap-able, see APCI_MMAP_SLOT_META */
+     __u64 dma_slot_seq;
+     int dma_overrun_pending;
+     int dma_ring_policy; /* APCI_RING_* */
+     dma_latency_t dma_latency; /* AxIO only, latency_us 0 when off */
+     __u32 dma_xfer_size; /* bytes per AxIO transfer, 0 = whole slot */
+     __u32 dma_xfer_inflight; /* bytes programmed for the slot being written */
+     u64 dma_flush_timeout_ns; /* 0 = no automatic flush */
+     u64 dma_last_complete_ns;
+     struct hrtimer dma_flush_timer;
+
+     dma_ring_ctl_t *ring_ctl; /* mmap-able read-write, see APCI_MMAP_RING */
+     __u32 read_offset; /* bytes of the first valid slot already read() */
+     struct mutex read_lock;
+     struct list_head dma_cursors; /* apci_files with their own cursor, under dma_data_lock */
+     int dma_lossless_cursors;
+     __u32 dma_dropped_newest; /* slots rewritten by DROP_NEWEST, seen by every cursor */
+     edge_counters_t *edge_counters; /* PCIe-IDIO only, see APCI_MMAP_EDGES */
+     spinlock_t status_lock; /* writers of the mmap-able pages */
+
+     /* Quadrature counter extension, QUAD cards only, see quad_state_t */
+     quad_state_t *quad; /* mmap-able, see APCI_MMAP_QUAD */
+     __u32 quad_raw[APCI_QUAD_CHANNELS]; /* last 24-bit hardware count */
+     __s64 quad_prev_position[APCI_QUAD_CHANNELS];
+     u64 quad_prev_ns;
+     u64 quad_period_ns;
+     struct hrtimer quad_timer;
+     spinlock_t quad_lock;
+
+     /* Kernel FIFO drain into the DMA ring, see fifo_drain_t */
+     __u32 fifo_drain_words;
+     __u32 fifo_fill; /* bytes already in the current slot */
+
+     /* Level trigger on AxIO DMA slots, scanned by level_work */
+     level_trigger_t level;
+     level_crossing_t level_crossing;
+     struct work_struct level_work;
+     atomic_t level_slots; /* completed slots not scanned yet */
+     atomic_t level_restart; /* DMA restarted, scan from slot 0 */
+     int level_scan_slot;
+     int level_above; /* -1 until the channel has been seen */
+     spinlock_t level_lock; /* level_crossing */
+
+     /* Event-to-action rules, run by apci_irq_thread */
+     action_rule_t actions[APCI_ACTION_RULES];
+     int action_count; /* enabled rules */
+     action_log_t *action_log; /* mmap-able, allocated with the first rule */
+     struct mutex action_lock;
+     atomic_t action_pending; /* events since the thread last ran */
+     atomic_t action_status; /* their status words, ORed */
+     u64 action_irq_ns;
+
+     /* Watchdog core integration, WDG cards only, see apci_wdt.c */
+     struct watchdog_device wdd;
+     int wdt_registered;
+     struct hrtimer wdt_timer; /* in-driver keepalive */
+     u64 wdt_ping_ns;
+     u64 wdt_heartbeat_ns;
+     u64 wdt_last_heartbeat;
+     spinlock_t wdt_lock;
+
+     /* Wakeup coalescing, see coalesce_settings_t */
+     __u32 coalesce_frames;
+     u64 coalesce_ns;
+     __u32 coalesce_pending;
+     struct hrtimer coalesce_timer;
+     spinlock_t coalesce_lock;
+     coalesce_stats_t coalesce_stats;
+
+     /* Automatic re-arm of IRQs the ISR had to disable, see rearm_settings_t */
+     int rearm;
+     __u8 rearm_mask[2];
+
+     /* CoS debounce, see debounce_stats_t. debounce_ns == 0 disables it. */
+     u64 debounce_ns;
+     __u8 debounce_cos_mask; /* mPCIe-II CoS enables to restore */
+     struct hrtimer debounce_timer;
+     debounce_stats_t debounce_stats;
+
+     int irq_affinity_cpu; /* -1 when no affinity hint is set */
+     struct cpumask irq_affinity_mask; /* must outlive the hint */
 };
 
+/* Per-open-file state, kept in filp->private_data. */
+struct apci_file {
+     struct apci_my_info *ddata;
+     struct list_head cursor_list; /* on ddata->dma_cursors unless APCI_CURSOR_SHARED */
+     int cursor_mode; /* APCI_CURSOR_* */
+     __u32 cursor; /* slot index modulo index_wrap, like dma_ring_ctl_t.consumer */
+     __u32 discarded; /* slots skipped since the last data_ready */
+     __u32 dropped_seen; /* dma_dropped_newest already reported */
+     __u32 read_offset; /* bytes of the cursor's slot already read() */
+};
+
+static inline void apci_hrtimer_setup(struct hrtimer *timer,
+                                      enum hrtimer_restart (*function)(struct hrtimer *))
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+     hrtimer_setup(timer, function, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+     hrtimer_init(timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+     timer->function = function;
+#endif
+}
+
+/* Ring index arithmetic modulo dma_ring_ctl_t.index_wrap; indices are
+ * always below it.
+ */
+static inline __u32 apci_ring_add(const dma_ring_ctl_t *ctl, __u32 index, __u32 n)
+{
+     return (index + n % ctl->index_wrap) % ctl->index_wrap;
+}
+
+static inline __u32 apci_ring_sub(const dma_ring_ctl_t *ctl, __u32 index, __u32 n)
+{
+     return (index + ctl->index_wrap - n % ctl->index_wrap) % ctl->index_wrap;
+}
+
+static inline __u32 apci_ring_dist(const dma_ring_ctl_t *ctl, __u32 from, __u32 to)
+{
+     return apci_ring_sub(ctl, to, from);
+}
+
+/* a is ahead of b (by less than half the index range) */
+static inline bool apci_ring_after(const dma_ring_ctl_t *ctl, __u32 a, __u32 b)
+{
+     __u32 dist = apci_ring_dist(ctl, b, a);
+
+     return dist && dist < ctl->index_wrap / 2;
+}
+
+int apci_is_axio(struct apci_my_info *ddata);
+int apci_set_irq_affinity_cpu(struct apci_my_info *ddata, int cpu);
+int apci_set_rearm_policy(struct apci_my_info *ddata, int enable, __u32 mask);
+void apci_snoop_write(struct apci_my_info *ddata, int bar, unsigned int offset, enum SIZE size, __u32 data);
+int apci_set_debounce_window(struct apci_my_info *ddata, unsigned long usecs);
+void apci_reset_edges(struct apci_my_info *ddata);
+int apci_quad_channels(struct apci_my_info *ddata);
+void apci_quad_sample(struct apci_my_info *ddata, int first, int count);
+void apci_quad_set_velocity_rate(struct apci_my_info *ddata, unsigned long hz);
+int apci_is_dma_capable(struct apci_my_info *ddata);
+int apci_dma_alloc_ring(struct apci_my_info *ddata, int num_slots, size_t slot_size);
+void apci_dma_free_ring(struct apci_my_info *ddata);
+void apci_dma_rewind(struct apci_my_info *ddata);
+int apci_dma_map_user(struct apci_my_info *ddata, const dma_user_buffer_t *buffer);
+void apci_ring_reset(struct apci_my_info *ddata);
+__u32 apci_ring_tail_locked(struct apci_my_info *ddata);
+void apci_ring_sync_locked(struct apci_my_info *ddata);
+void apci_ring_consume_locked(struct apci_my_info *ddata, __u32 slots);
+int apci_dma_flush(struct apci_my_info *ddata);
+int apci_dma_set_flush_timeout(struct apci_my_info *ddata, unsigned long ms);
+int apci_set_dma_latency_cfg(struct apci_my_info *ddata, dma_latency_t *lat);
+int apci_set_fifo_drain_cfg(struct apci_my_info *ddata, const fifo_drain_t *drain);
+int apci_set_level_trigger_cfg(struct apci_my_info *ddata, const level_trigger_t *level);
+void apci_level_reset(struct apci_my_info *ddata);
+int apci_set_action_rule(struct apci_my_info *ddata, const action_rule_t *rule);
+int apci_dmabuf_export(struct apci_my_info *ddata, unsigned long which);
+int apci_dmabuf_lock_buffer(struct apci_my_info *ddata, unsigned long which);
+void apci_dmabuf_unlock_buffer(void);
+void apci_dmabuf_detach(struct apci_my_info *ddata);
+int apci_wdt_register(struct apci_my_info *ddata);
+void apci_wdt_unregister(struct apci_my_info *ddata);
+void apci_wdt_irq(struct apci_my_info *ddata);
+int apci_wdt_set_keepalive(struct apci_my_info *ddata, const wdt_keepalive_t *keepalive);
+int apci_wdt_heartbeat(struct apci_my_info *ddata);
+void apci_poll_stop(struct apci_my_info *ddata);
+void apci_set_coalescing(struct apci_my_info *ddata, __u32 frames, __u32 usecs);
+
 int probe(struct pci_dev *dev, const struct pci_device_id *id);
 void remove(struct pci_dev *dev);
 void delete_driver(struct pci_dev *dev);
@@ -0,0 +1,343 @@
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+
+#include "apci_dev.h"
+
+/* dma-buf export of a card's DMA ring and DAC staging buffer, so another
+ * process can be handed an fd and mmap the memory directly. The export
+ * describes the memory on its own: while it is alive the ioctls that would
+ * free or replace the buffer fail with -EBUSY. remove() does not wait for
+ * the importers: it detaches the export, which then refuses new mappings
+ * and frees the memory itself once the last reference is gone.
+ */
+
+#if IS_ENABLED(CONFIG_DMA_SHARED_BUFFER) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+
+struct apci_dmabuf {
+  struct apci_my_info *ddata;
+  struct dma_buf *dmabuf;
+  struct device *dev;
+  int which; /* APCI_DMABUF_* */
+  void *vaddr;
+  dma_addr_t addr; /* ring only */
+  struct page *page; /* first page, when not coherent */
+  size_t size;
+  size_t alloc_size; /* of the whole allocation, for a dead export to free */
+  bool coherent;
+  bool dead; /* the card is gone and the memory is ours */
+};
+
+/* ddata->dma_export and ddata->dac_export, and the buffers they describe */
+static DEFINE_MUTEX(apci_dmabuf_lock);
+
+static struct apci_dmabuf **apci_dmabuf_slot(struct apci_my_info *ddata, int which)
+{
+  return which == APCI_DMABUF_RING ? &ddata->dma_export : &ddata->dac_export;
+}
+
+static struct sg_table *apci_dmabuf_map(struct dma_buf_attachment *attach,
+                                        enum dma_data_direction dir)
+{
+  struct apci_dmabuf *exp = attach->dmabuf->priv;
+  struct sg_table *sgt;
+  int ret;
+
+  if (READ_ONCE(exp->dead))
+    return ERR_PTR(-ENODEV);
+
+  sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+  if (!sgt)
+    return ERR_PTR(-ENOMEM);
+
+  if (exp->coherent)
+  {
+    ret = dma_get_sgtable(exp->dev, sgt, exp->vaddr, exp->addr, exp->size);
+  }
+  else
+  {
+    ret = sg_alloc_table(sgt, 1, GFP_KERNEL);
+    if (!ret)
+      sg_set_page(sgt->sgl, exp->page, exp->size, 0);
+  }
+  if (ret)
+    goto out_free;
+
+  ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+  if (ret)
+    goto out_table;
+  return sgt;
+
+out_table:
+  sg_free_table(sgt);
+out_free:
+  kfree(sgt);
+  return ERR_PTR(ret);
+}
+
+static void apci_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+                              enum dma_data_direction dir)
+{
+  dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+  sg_free_table(sgt);
+  kfree(sgt);
+}
+
+static int apci_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+  struct apci_dmabuf *exp = dmabuf->priv;
+  unsigned long pages = vma_pages(vma);
+
+  if (READ_ONCE(exp->dead))
+    return -ENODEV;
+  if (vma->vm_pgoff + pages > PAGE_ALIGN(exp->size) >> PAGE_SHIFT)
+    return -EINVAL;
+
+  if (exp->coherent)
+    return dma_mmap_coherent(exp->dev, vma, exp->vaddr, exp->addr, exp->size);
+
+  return remap_pfn_range(vma, vma->vm_start, page_to_pfn(exp->page) + vma->vm_pgoff,
+                         vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+/* A ring from dma_alloc_pages() is not coherent: the CPU side has to be
+ * synced around importer access, the same as apci_dma_read does.
+ */
+static int apci_dmabuf_begin_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+  struct apci_dmabuf *exp = dmabuf->priv;
+
+  if (!exp->coherent && exp->which == APCI_DMABUF_RING)
+    dma_sync_single_for_cpu(exp->dev, exp->addr, exp->size, DMA_FROM_DEVICE);
+  return 0;
+}
+
+static int apci_dmabuf_end_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+  struct apci_dmabuf *exp = dmabuf->priv;
+
+  if (!exp->coherent && exp->which == APCI_DMABUF_RING)
+    dma_sync_single_for_device(exp->dev, exp->addr, exp->size, DMA_FROM_DEVICE);
+  return 0;
+}
+
+/* Free the memory remove() handed over to a dead export. */
+static void apci_dmabuf_free(struct apci_dmabuf *exp)
+{
+  if (exp->which == APCI_DMABUF_DAC)
+    kfree(exp->vaddr);
+  else if (exp->coherent)
+    dma_free_coherent(exp->dev, exp->alloc_size, exp->vaddr, exp->addr);
+  else
+    dma_free_pages(exp->dev, exp->alloc_size, exp->page, exp->addr, DMA_FROM_DEVICE);
+}
+
+/* Last reference gone: forget the export, or free the memory of one the
+ * card left behind.
+ */
+static void apci_dmabuf_release(struct dma_buf *dmabuf)
+{
+  struct apci_dmabuf *exp = dmabuf->priv;
+
+  mutex_lock(&apci_dmabuf_lock);
+  if (!exp->dead)
+    *apci_dmabuf_slot(exp->ddata, exp->which) = NULL;
+  mutex_unlock(&apci_dmabuf_lock);
+
+  if (exp->dead)
+    apci_dmabuf_free(exp);
+  put_device(exp->dev);
+  kfree(exp);
+}
+
+static const struct dma_buf_ops apci_dmabuf_ops = {
+  .map_dma_buf = apci_dmabuf_map,
+  .unmap_dma_buf = apci_dmabuf_unmap,
+  .begin_cpu_access = apci_dmabuf_begin_cpu_access,
+  .end_cpu_access = apci_dmabuf_end_cpu_access,
+  .mmap = apci_dmabuf_mmap,
+  .release = apci_dmabuf_release,
+};
+
+/* Describe the current ring or DAC buffer. Caller holds apci_dmabuf_lock. */
+static int apci_dmabuf_fill(struct apci_my_info *ddata, struct apci_dmabuf *exp)
+{
+  if (exp->which == APCI_DMABUF_DAC)
+  {
+    if (ddata->dac_fifo_buffer == NULL)
+      return -ENODEV;
+    exp->vaddr = ddata->dac_fifo_buffer;
+    exp->page = virt_to_page(ddata->dac_fifo_buffer);
+    exp->size = ddata->dac_fifo_size;
+    return 0;
+  }
+
+  if (ddata->dma_virt_addr == NULL)
+    return -ENODEV;
+  if (ddata->dma_user_pages != NULL)
+    return -EINVAL; /* the user owns that memory already */
+
+  exp->vaddr = ddata->dma_virt_addr;
+  exp->addr = ddata->dma_addr;
+  exp->size = (size_t)ddata->dma_num_slots * ddata->dma_slot_size;
+  if (ddata->dma_pages != NULL)
+    exp->page = ddata->dma_pages;
+  else
+    exp->coherent = true;
+  return 0;
+}
+
+/* Returns a new dma-buf fd for the ring or DAC buffer; exporting again
+ * hands out another fd for the same dma-buf. Process context.
+ */
+int apci_dmabuf_export(struct apci_my_info *ddata, unsigned long which)
+{
+  DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+  struct apci_dmabuf **slot;
+  struct apci_dmabuf *exp;
+  struct dma_buf *dmabuf;
+  int ret;
+
+  if (which > APCI_DMABUF_DAC)
+    return -EINVAL;
+
+  mutex_lock(&apci_dmabuf_lock);
+  slot = apci_dmabuf_slot(ddata, which);
+  if (*slot)
+  {
+    dmabuf = (*slot)->dmabuf;
+    get_dma_buf(dmabuf);
+    goto out_fd;
+  }
+
+  exp = kzalloc(sizeof(*exp), GFP_KERNEL);
+  if (!exp)
+  {
+    ret = -ENOMEM;
+    goto out_unlock;
+  }
+  exp->which = which;
+  ret = apci_dmabuf_fill(ddata, exp);
+  if (ret)
+  {
+    kfree(exp);
+    goto out_unlock;
+  }
+  exp->ddata = ddata;
+  exp->dev = get_device(&ddata->pci_dev->dev);
+
+  exp_info.ops = &apci_dmabuf_ops;
+  exp_info.size = exp->size;
+  exp_info.flags = O_RDWR;
+  exp_info.priv = exp;
+  dmabuf = dma_buf_export(&exp_info);
+  if (IS_ERR(dmabuf))
+  {
+    put_device(exp->dev);
+    kfree(exp);
+    ret = PTR_ERR(dmabuf);
+    goto out_unlock;
+  }
+  exp->dmabuf = dmabuf;
+  *slot = exp;
+
+out_fd:
+  mutex_unlock(&apci_dmabuf_lock);
+  ret = dma_buf_fd(dmabuf, O_RDWR | O_CLOEXEC);
+  if (ret < 0)
+    dma_buf_put(dmabuf);
+  return ret;
+
+out_unlock:
+  mutex_unlock(&apci_dmabuf_lock);
+  return ret;
+}
+
+/* Hold off exports and release of the ring (or DAC buffer) while the
+ * caller frees or replaces it: returns -EBUSY while it is exported,
+ * otherwise 0 with the lock held until apci_dmabuf_unlock_buffer().
+ */
+int apci_dmabuf_lock_buffer(struct apci_my_info *ddata, unsigned long which)
+{
+  mutex_lock(&apci_dmabuf_lock);
+  if (*apci_dmabuf_slot(ddata, which) != NULL)
+  {
+    mutex_unlock(&apci_dmabuf_lock);
+    return -EBUSY;
+  }
+  return 0;
+}
+
+void apci_dmabuf_unlock_buffer(void)
+{
+  mutex_unlock(&apci_dmabuf_lock);
+}
+
+/* The card is going away while importers may still hold its buffers:
+ * mark the exports dead and hand them the memory, taking it from ddata so
+ * remove() does not free it. Process context, DMA and IRQs stopped.
+ */
+void apci_dmabuf_detach(struct apci_my_info *ddata)
+{
+  struct apci_dmabuf *exp;
+  unsigned long flags;
+
+  mutex_lock(&apci_dmabuf_lock);
+  exp = ddata->dma_export;
+  if (exp)
+  {
+    exp->alloc_size = exp->size;
+    if (exp->coherent && exp->vaddr == ddata->dma_prealloc_virt)
+    {
+      exp->alloc_size = ddata->dma_prealloc_size;
+      ddata->dma_prealloc_virt = NULL;
+      ddata->dma_prealloc_size = 0;
+    }
+    spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+    ddata->dma_virt_addr = NULL;
+    ddata->dma_pages = NULL;
+    spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+    WRITE_ONCE(exp->dead, true);
+    exp->ddata = NULL;
+    ddata->dma_export = NULL;
+  }
+
+  exp = ddata->dac_export;
+  if (exp)
+  {
+    ddata->dac_fifo_buffer = NULL;
+    ddata->dac_fifo_size = 0;
+    WRITE_ONCE(exp->dead, true);
+    exp->ddata = NULL;
+    ddata->dac_export = NULL;
+  }
+  mutex_unlock(&apci_dmabuf_lock);
+}
+
+#else /* !CONFIG_DMA_SHARED_BUFFER */
+
+int apci_dmabuf_export(struct apci_my_info *ddata, unsigned long which)
+{
+  return -EOPNOTSUPP;
+}
+
+int apci_dmabuf_lock_buffer(struct apci_my_info *ddata, unsigned long which)
+{
+  return 0;
+}
+
+void apci_dmabuf_unlock_buffer(void)
+{
+}
+
+void apci_dmabuf_detach(struct apci_my_info *ddata)
+{
+}
+
+#endif
@@ -27,24 +27,48 @@ address_type is_valid_addr(struct apci_my_info *driver_data, int bar, int addr)
     return INVALID;
 }
 
+/* An action program may only touch whole, aligned registers inside a
+ * valid BAR. Checked without forming offset + size, which could wrap.
+ */
+static bool action_addr_ok(struct apci_my_info *ddata, __u8 bar, __u32 offset, __u8 size)
+{
+     resource_size_t len;
+
+     if (bar >= 6 || size > DWORD) return false;
+     if (ddata->regions[bar].start == 0) return false;
+     if (offset & ((1u << size) - 1)) return false;
+
+     len = ddata->regions[bar].length;
+     return offset < len && (1u << size) <= len - offset;
+}
+
 int open_apci( pInode inode, pFile filp )
 {
   struct apci_my_info *ddata;
+  struct apci_file *file;
   apci_debug("Opening device\n");
   ddata = container_of( inode->i_cdev, struct apci_my_info, cdev );
   /* need to check to see if the device is
      Blocking  / nonblocking */
 
-  filp->private_data = ddata;
+  file = kzalloc(sizeof(*file), GFP_KERNEL);
+  if (!file) return -ENOMEM;
+  file->ddata = ddata;
+  INIT_LIST_HEAD(&file->cursor_list);
+  file->cursor_mode = APCI_CURSOR_SHARED;
+
+  filp->private_data = file;
+#ifdef FMODE_NOWAIT
+  filp->f_mode |= FMODE_NOWAIT; /* read_iter_apci honours IOCB_NOWAIT */
+#endif
   ddata->waiting_for_irq = 0;
   return 0;
 }
 
-
 ssize_t read_apci(struct file *filp, char __user *buf,
                          size_t len, loff_t *off)
 {
-    struct apci_my_info  *ddata = filp->private_data ;
+    struct apci_my_info  *ddata = ((struct apci_file *)filp->private_data)->ddata;
     int status;
     unsigned int value = inb( ddata->regions[2].start + 0x1 );
     status = copy_to_user(buf, &value, 1);
@@ -52,6 +76,386 @@ ssize_t read_apci(struct file *filp, char __user *buf,
 }
 
 
+/* Fill in data_ready from the DMA ring indices and hand over the discard
+ * count, resetting it if consume. Caller holds dma_data_lock.
+ */
+static void apci_shared_get_ready_locked(struct apci_my_info *ddata, data_ready_t *data_ready, bool consume)
+{
+     int last_valid;
+
+     apci_ring_sync_locked(ddata);
+     if (( ddata->dma_last_buffer < 0 ) || (ddata->dma_first_valid == -1))
+     {
+          data_ready->slots = 0;
+     }
+     else if (ddata->dma_first_valid == ddata->dma_last_buffer)
+     {
+          data_ready->slots = 0;
+     }
+     else
+     {
+          data_ready->start_index = ddata->dma_first_valid;
+          last_valid = ddata->dma_last_buffer - 1;
+
+          if (last_valid == -1) last_valid = ddata->dma_num_slots - 1;
+
+          apci_debug("last_valid = %d, ddata_dma_last_buffer = %d\n", last_valid, ddata->dma_last_buffer);
+
+          if (last_valid >= data_ready->start_index)
+          {
+               data_ready->slots = last_valid - data_ready->start_index +1;
+          }
+          else
+          {
+               data_ready->slots = ddata->dma_num_slots - data_ready->start_index + last_valid + 1;
+          }
+     }
+
+     apci_debug("data_ready.start_index = %d, ddata->dma_last_buffer = %d, data_ready.slots = %d\n", data_ready->start_index, ddata->dma_last_buffer, data_ready->slots);
+
+     data_ready->data_discarded = ddata->dma_data_discarded;
+     if (consume)
+          ddata->dma_data_discarded = 0;
+}
+
+/* Move the shared consumer index up to the slowest lossless cursor so
+ * the ISR only holds back for those. Caller holds dma_data_lock.
+ */
+static void apci_cursors_update_locked(struct apci_my_info *ddata)
+{
+     dma_ring_ctl_t *ctl = ddata->ring_ctl;
+     struct apci_file *file;
+     __u32 producer = ctl->producer;
+     __u32 slowest = producer;
+
+     if (ddata->dma_lossless_cursors == 0) return;
+
+     list_for_each_entry(file, &ddata->dma_cursors, cursor_list)
+     {
+          if (file->cursor_mode != APCI_CURSOR_LOSSLESS) continue;
+          if (apci_ring_dist(ctl, file->cursor, producer) > apci_ring_dist(ctl, slowest, producer))
+               slowest = file->cursor;
+     }
+     /* a cursor the ring policy ran over catches up on its own */
+     if (apci_ring_after(ctl, slowest, ctl->consumer % ctl->index_wrap))
+     {
+          smp_store_release(&ctl->consumer, slowest);
+          apci_ring_sync_locked(ddata);
+     }
+}
+
+/* A cursor more than a ring behind the producer has lost the slots in
+ * between: skip to the oldest slot still intact and count the rest.
+ * Caller holds dma_data_lock.
+ */
+static void apci_cursor_catch_up_locked(struct apci_file *file)
+{
+     struct apci_my_info *ddata = file->ddata;
+     dma_ring_ctl_t *ctl = ddata->ring_ctl;
+     __u32 producer = ctl->producer;
+     __u32 lag = apci_ring_dist(ctl, file->cursor, producer);
+
+     if (apci_ring_after(ctl, file->cursor, producer))
+     {
+          file->cursor = producer;
+     }
+     else if (lag > ddata->dma_num_slots - 1)
+     {
+          file->discarded += lag - (ddata->dma_num_slots - 1);
+          file->cursor = apci_ring_sub(ctl, producer, ddata->dma_num_slots - 1);
+          file->read_offset = 0;
+     }
+}
+
+/* Drop the file's own cursor, which may let the ISR move on. Caller
+ * holds dma_data_lock.
+ */
+static void apci_cursor_detach_locked(struct apci_file *file)
+{
+     struct apci_my_info *ddata = file->ddata;
+
+     if (file->cursor_mode == APCI_CURSOR_SHARED) return;
+
+     list_del_init(&file->cursor_list);
+     if (file->cursor_mode == APCI_CURSOR_LOSSLESS)
+     {
+          ddata->dma_lossless_cursors--;
+          apci_cursors_update_locked(ddata);
+     }
+     file->cursor_mode = APCI_CURSOR_SHARED;
+}
+
+/* Give the file its own cursor (or hand it back to the shared one). A new
+ * cursor starts at the oldest slot the ring still holds.
+ */
+static int apci_set_cursor_mode(struct apci_file *file, unsigned long mode)
+{
+     struct apci_my_info *ddata = file->ddata;
+     unsigned long flags;
+
+     if (mode > APCI_CURSOR_LOSSY) return -EINVAL;
+
+     spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+     apci_cursor_detach_locked(file);
+     if (mode != APCI_CURSOR_SHARED)
+     {
+          file->cursor_mode = mode;
+          file->cursor = apci_ring_tail_locked(ddata);
+          file->discarded = 0;
+          file->dropped_seen = ddata->dma_dropped_newest;
+          file->read_offset = 0;
+          list_add_tail(&file->cursor_list, &ddata->dma_cursors);
+          if (mode == APCI_CURSOR_LOSSLESS)
+               ddata->dma_lossless_cursors++;
+     }
+     spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+     return 0;
+}
+
+int release_apci( pInode inode, pFile filp )
+{
+  struct apci_file *file = filp->private_data;
+  struct apci_my_info *ddata = file->ddata;
+  unsigned long flags;
+
+  spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+  apci_cursor_detach_locked(file);
+  spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+
+  kfree(file);
+  return 0;
+}
+
+/* Slots between the file's cursor and the producer. Caller holds
+ * dma_data_lock.
+ */
+static int apci_dma_slots_ready_locked(struct apci_file *file)
+{
+     struct apci_my_info *ddata = file->ddata;
+     int slots = 0;
+
+     if (file->cursor_mode != APCI_CURSOR_SHARED)
+     {
+          if (ddata->dma_num_slots == 0) return 0;
+          apci_cursor_catch_up_locked(file);
+          return apci_ring_dist(ddata->ring_ctl, file->cursor, ddata->ring_ctl->producer);
+     }
+
+     apci_ring_sync_locked(ddata);
+     if ((ddata->dma_last_buffer >= 0) && (ddata->dma_first_valid != -1))
+     {
+          slots = ddata->dma_last_buffer - ddata->dma_first_valid;
+          if (slots < 0) slots += ddata->dma_num_slots;
+     }
+     return slots;
+}
+
+/* data_ready for this file, handing over its discard count (and
+ * resetting it if consume). Caller holds dma_data_lock.
+ */
+static void apci_dma_get_ready_locked(struct apci_file *file, data_ready_t *data_ready, bool consume)
+{
+     struct apci_my_info *ddata = file->ddata;
+
+     if (file->cursor_mode == APCI_CURSOR_SHARED)
+     {
+          apci_shared_get_ready_locked(ddata, data_ready, consume);
+          return;
+     }
+
+     data_ready->slots = apci_dma_slots_ready_locked(file);
+     if (ddata->dma_num_slots)
+          data_ready->start_index = file->cursor % ddata->dma_num_slots;
+     data_ready->data_discarded = file->discarded + (ddata->dma_dropped_newest - file->dropped_seen);
+     if (consume)
+     {
+          file->discarded = 0;
+          file->dropped_seen = ddata->dma_dropped_newest;
+     }
+}
+
+/* Number of slots holding valid data for this file, for wait conditions. */
+static int apci_dma_slots_ready(struct apci_file *file)
+{
+     unsigned long flags;
+     int slots;
+
+     spin_lock_irqsave(&(file->ddata->dma_data_lock), flags);
+     slots = apci_dma_slots_ready_locked(file);
+     spin_unlock_irqrestore(&(file->ddata->dma_data_lock), flags);
+
+     return slots;
+}
+
+/* apci_wait_for_data is satisfied: min_slots ready and, with the level
+ * trigger on, a crossing since the count was crossings.
+ */
+static bool apci_dma_wait_done(struct apci_file *file, __u32 min_slots, bool level, __u32 crossings)
+{
+     if (level && READ_ONCE(file->ddata->level_crossing.count) == crossings)
+          return false;
+     return apci_dma_slots_ready(file) >= min_slots;
+}
+
+/* Give num_slots consumed slots back, from the file's cursor or from the
+ * shared one. Caller holds dma_data_lock.
+ */
+static void apci_dma_release_locked(struct apci_file *file, unsigned long num_slots)
+{
+     struct apci_my_info *ddata = file->ddata;
+
+     apci_debug("Adding %lu to first_valid", num_slots);
+     if (file->cursor_mode == APCI_CURSOR_SHARED)
+     {
+          apci_ring_consume_locked(ddata, num_slots);
+     }
+     else
+     {
+          num_slots = min_t(unsigned long, num_slots, apci_dma_slots_ready_locked(file));
+          file->cursor = apci_ring_add(ddata->ring_ctl, file->cursor, num_slots);
+          if (file->cursor_mode == APCI_CURSOR_LOSSLESS)
+               apci_cursors_update_locked(ddata);
+     }
+}
+
+static void apci_dma_release(struct apci_file *file, unsigned long num_slots)
+{
+     unsigned long flags;
+
+     spin_lock_irqsave(&(file->ddata->dma_data_lock), flags);
+     apci_dma_release_locked(file, num_slots);
+     spin_unlock_irqrestore(&(file->ddata->dma_data_lock), flags);
+}
+
+/* Ring slot the file reads next. Caller holds dma_data_lock. */
+static int apci_dma_read_slot_locked(struct apci_file *file)
+{
+     if (file->cursor_mode == APCI_CURSOR_SHARED)
+          return file->ddata->dma_first_valid;
+     return file->cursor % file->ddata->dma_num_slots;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+/* read() must not sleep: O_NONBLOCK, or io_uring trying it inline before
+ * it arms poll_apci.
+ */
+static bool apci_read_nowait(struct kiocb *iocb)
+{
+#ifdef IOCB_NOWAIT
+     if (iocb->ki_flags & IOCB_NOWAIT) return true;
+#endif
+     return iocb->ki_filp->f_flags & O_NONBLOCK;
+}
+
+/* Stream the DMA ring: block until a slot is ready (unless non-blocking),
+ * copy out as much as fits and release each slot once its valid bytes
+ * (slot_meta_t.bytes) have been read. Also backs splice(). Cards without
+ * a DMA ring keep the one-byte read of read_apci. read_lock keeps the
+ * ring from being replaced under the copy; the read offset only moves
+ * under dma_data_lock, and only if the ISR has not dropped the slot
+ * meanwhile.
+ */
+ssize_t read_iter_apci(struct kiocb *iocb, struct iov_iter *to)
+{
+     struct apci_file *file = iocb->ki_filp->private_data;
+     struct apci_my_info *ddata = file->ddata;
+     __u32 *read_offset;
+     unsigned long flags;
+     ssize_t copied = 0;
+     size_t chunk, done;
+     __u32 slot_bytes, offset;
+     int slot;
+
+     if (ddata->dma_virt_addr == NULL)
+     {
+          __u8 value = inb(ddata->regions[2].start + 0x1);
+          return (copy_to_iter(&value, 1, to) == 1) ? 1 : -EFAULT;
+     }
+
+     if (apci_read_nowait(iocb))
+     {
+          if (!mutex_trylock(&ddata->read_lock)) return -EAGAIN;
+     }
+     else if (mutex_lock_interruptible(&ddata->read_lock)) return -ERESTARTSYS;
+     read_offset = (file->cursor_mode == APCI_CURSOR_SHARED) ? &ddata->read_offset : &file->read_offset;
+
+     while (iov_iter_count(to))
+     {
+          if (apci_dma_slots_ready(file) == 0)
+          {
+               if (copied) break;
+               if (apci_read_nowait(iocb))
+               {
+                    copied = -EAGAIN;
+                    break;
+               }
+               mutex_unlock(&ddata->read_lock);
+               if (wait_event_interruptible(ddata->dma_wait_queue, apci_dma_slots_ready(file) > 0))
+                    return -ERESTARTSYS;
+               if (mutex_lock_interruptible(&ddata->read_lock)) return -ERESTARTSYS;
+               continue;
+          }
+
+          spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+          if (ddata->dma_slot_meta == NULL || ddata->dma_virt_addr == NULL)
+          {
+               /* the ring went away while we waited for it */
+               spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+               if (copied == 0) copied = -ENODEV;
+               break;
+          }
+          slot = apci_dma_read_slot_locked(file);
+          offset = *read_offset;
+          slot_bytes = ddata->dma_slot_meta[slot].bytes;
+          spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+          if (slot_bytes == 0 || slot_bytes > ddata->dma_slot_size) slot_bytes = ddata->dma_slot_size;
+
+          chunk = min_t(size_t, iov_iter_count(to), slot_bytes - offset);
+          done = copy_to_iter((u8 *)ddata->dma_virt_addr + ddata->dma_slot_size * slot + offset,
+                              chunk, to);
+          copied += done;
+
+          spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+          if (apci_dma_read_slot_locked(file) == slot && *read_offset == offset)
+          {
+               *read_offset += done;
+               if (*read_offset >= slot_bytes)
+               {
+                    *read_offset = 0;
+                    apci_dma_release_locked(file, 1);
+               }
+          }
+          spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+          if (done < chunk)
+          {
+               if (copied == 0) copied = -EFAULT;
+               break;
+          }
+     }
+
+     mutex_unlock(&ddata->read_lock);
+     return copied;
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+/* Readable once the file's cursor (or the shared one) has a slot ready.
+ * Together with the non-blocking read_iter this lets epoll and io_uring,
+ * multishot reads included, stream the ring without a thread blocked in
+ * read() per card.
+ */
+__poll_t poll_apci(struct file *filp, poll_table *wait)
+{
+     struct apci_file *file = filp->private_data;
+     struct apci_my_info *ddata = file->ddata;
+
+     if (ddata->dma_virt_addr == NULL) return EPOLLIN | EPOLLRDNORM;
+
+     poll_wait(filp, &ddata->dma_wait_queue, wait);
+     return apci_dma_slots_ready(file) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,39 )
 int ioctl_apci(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg)
 #else
@@ -60,7 +464,8 @@ long  ioctl_apci(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     int count;
     int status;
-    struct apci_my_info *ddata = filp->private_data;
+    struct apci_file *file = filp->private_data;
+    struct apci_my_info *ddata = file->ddata;
     info_struct info;
     iopack io_pack;
     buff_iopack buff_pack;
@@ -150,6 +555,7 @@ long  ioctl_apci(struct file *filp, unsigned int cmd, unsigned long arg)
 
           switch(is_valid_addr(ddata, io_pack.bar,io_pack.offset)) {
                case IO:
+                    apci_snoop_write(ddata, io_pack.bar, io_pack.offset, io_pack.size, io_pack.data);
                     apci_info("performing I/O write to %llX\n",
                          ddata->regions[io_pack.bar].start + io_pack.offset);
 
@@ -337,30 +743,17 @@ long  ioctl_apci(struct file *filp, unsigned int cmd, unsigned long arg)
                          (dma_buffer_settings_t *) arg,
                          sizeof(dma_buffer_settings_t));
 
-               if (ddata->dma_virt_addr != NULL)
-               {
-                    dma_free_coherent(&(ddata->pci_dev->dev),
-                         ddata->dma_num_slots * ddata->dma_slot_size,
-                         ddata->dma_virt_addr,
-                         ddata->dma_addr);
-
-                    ddata->dma_num_slots = 0;
-                    ddata->dma_virt_addr = NULL;
-                    ddata->dma_addr = 0;
-                    ddata->dma_slot_size = 0;
-               }
-
-               ddata->dma_num_slots = settings.num_slots;
-               ddata->dma_slot_size = settings.slot_size;
-
-               ddata->dma_virt_addr = dma_alloc_coherent(&(ddata->pci_dev->dev),
-                                        ddata->dma_num_slots * ddata->dma_slot_size,
-                                        &(ddata->dma_addr),
-                                        GFP_KERNEL);
-               if (ddata->dma_virt_addr == NULL) return -ENOMEM;
-               ddata->dma_last_buffer = -1;
-               ddata->dma_first_valid = -1;
-               ddata->dma_data_discarded = 0;
+               status = apci_dmabuf_lock_buffer(ddata, APCI_DMABUF_RING);
+               if (status) return status;
+               mutex_lock(&ddata->read_lock);
+               apci_level_reset(ddata);
+               WRITE_ONCE(ddata->fifo_drain_words, 0);
+
+               apci_dma_free_ring(ddata);
+               status = apci_dma_alloc_ring(ddata, settings.num_slots, settings.slot_size);
+               mutex_unlock(&ddata->read_lock);
+               apci_dmabuf_unlock_buffer();
+               if (status) return status;
           }
 
           break;
@@ -377,41 +770,10 @@ long  ioctl_apci(struct file *filp, unsigned int cmd, unsigned long arg)
           if (status == 0) return -EACCES;
           {
                unsigned long flags;
-               int last_valid;
                data_ready_t data_ready = {0};
 
                spin_lock_irqsave(&(ddata->dma_data_lock), flags);
-               if (( ddata->dma_last_buffer < 0 ) || (ddata->dma_first_valid == -1))
-               {
-                    data_ready.slots = 0;
-               }
-               else if (ddata->dma_first_valid == ddata->dma_last_buffer)
-               {
-                    data_ready.slots = 0;
-               }
-               else
-               {
-                    data_ready.start_index = ddata->dma_first_valid;
-                    last_valid = ddata->dma_last_buffer - 1;
-
-                    if (last_valid == -1) last_valid = ddata->dma_num_slots - 1;
-
-                    apci_debug("last_valid = %d, ddata_dma_last_buffer = %d\n", last_valid, ddata->dma_last_buffer);
-
-                    if (last_valid >= data_ready.start_index)
-                    {
-                         data_ready.slots = last_valid - data_ready.start_index +1;
-                    }
-                    else
-                    {
-                         data_ready.slots = ddata->dma_num_slots - data_ready.start_index + last_valid + 1;
-                    }
-               }
-
-               apci_debug("data_ready.start_index = %d, ddata->dma_last_buffer = %d, data_ready.slots = %d\n", data_ready.start_index, ddata->dma_last_buffer, data_ready.slots);
-
-               data_ready.data_discarded = ddata->dma_data_discarded;
-               ddata->dma_data_discarded = 0;
+               apci_dma_get_ready_locked(file, &data_ready, true);
                spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
 
                apci_debug("start_index = %d, first_valid = %d, num_slots = %d, discarded = %d\n", data_ready.start_index, ddata->dma_first_valid, data_ready.slots, data_ready.data_discarded);
@@ -422,15 +784,58 @@ long  ioctl_apci(struct file *filp, unsigned int cmd, unsigned long arg)
           break;
 
      case apci_data_done:
+          apci_dma_release(file, arg);
+          break;
+
+     case apci_wait_for_data:
           {
+               dma_wait_t dma_wait;
                unsigned long flags;
+               long remaining;
+               bool level, crossed;
+               __u32 crossings;
+
+               status = copy_from_user(&dma_wait, (dma_wait_t *) arg, sizeof(dma_wait_t));
+               if (status) return -EFAULT;
+
+               if (ddata->dma_virt_addr == NULL) return -ENODEV;
+               if (dma_wait.min_slots == 0 || dma_wait.min_slots >= ddata->dma_num_slots)
+                    return -EINVAL;
+
+               if (dma_wait.release_slots)
+                    apci_dma_release(file, dma_wait.release_slots);
+
+               /* with the level trigger on, the wait also needs a crossing */
+               level = READ_ONCE(ddata->level.enable);
+               crossings = READ_ONCE(ddata->level_crossing.count);
+               if (dma_wait.timeout_ms)
                {
-                    spin_lock_irqsave(&(ddata->dma_data_lock), flags);
-                    apci_debug("Adding %lu to first_valid", arg);
-                    ddata->dma_first_valid += arg;
-                    ddata->dma_first_valid %= ddata->dma_num_slots;
-                    spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+                    remaining = wait_event_interruptible_timeout(ddata->dma_wait_queue,
+                                   apci_dma_wait_done(file, dma_wait.min_slots, level, crossings),
+                                   msecs_to_jiffies(dma_wait.timeout_ms));
                }
+               else
+               {
+                    remaining = wait_event_interruptible(ddata->dma_wait_queue,
+                                   apci_dma_wait_done(file, dma_wait.min_slots, level, crossings));
+                    if (remaining == 0) remaining = 1;
+               }
+               if (remaining < 0) return remaining;
+               crossed = !level || READ_ONCE(ddata->level_crossing.count) != crossings;
+
+               /* a timed-out wait reports the discards but leaves them for
+                * the next call, since the caller gets an error back
+                */
+               memset(&dma_wait.ready, 0, sizeof(data_ready_t));
+               spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+               apci_dma_get_ready_locked(file, &dma_wait.ready,
+                                         crossed && apci_dma_slots_ready_locked(file) >= dma_wait.min_slots);
+               spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+
+               status = copy_to_user((dma_wait_t *) arg, &dma_wait, sizeof(dma_wait_t));
+               if (status) return -EFAULT;
+
+               if (!crossed || dma_wait.ready.slots < dma_wait.min_slots) return -ETIMEDOUT;
           }
           break;
 
@@ -524,15 +929,351 @@ long  ioctl_apci(struct file *filp, unsigned int cmd, unsigned long arg)
           break;
      case apci_set_dac_buff_size:
           apci_debug("Setting dac fifo size");
+          status = apci_dmabuf_lock_buffer(ddata, APCI_DMABUF_DAC);
+          if (status) return status;
           if (ddata->dac_fifo_buffer != NULL)
           {
                kfree(ddata->dac_fifo_buffer);
                ddata->dac_fifo_buffer = NULL;
+               ddata->dac_fifo_size = 0;
           }
 
           if (0 != arg)
           {
-               ddata->dac_fifo_buffer = kmalloc(arg, GFP_KERNEL);
+               /* whole pages, so it can be mapped and exported as is */
+               ddata->dac_fifo_buffer = kmalloc(PAGE_ALIGN(arg), GFP_KERNEL);
+               if (ddata->dac_fifo_buffer != NULL)
+                    ddata->dac_fifo_size = PAGE_ALIGN(arg);
+               else
+                    status = -ENOMEM;
+          }
+          apci_dmabuf_unlock_buffer();
+          if (status) return status;
+          break;
+
+     case apci_set_poll_settings:
+          {
+               poll_settings_t settings;
+
+               if (!apci_is_axio(ddata)) return -EOPNOTSUPP;
+
+               status = copy_from_user(&settings, (poll_settings_t *) arg,
+                                       sizeof(poll_settings_t));
+               if (status) return -EFAULT;
+
+               if (settings.enter_rate && (settings.interval_us == 0 ||
+                                           settings.exit_rate >= settings.enter_rate))
+                    return -EINVAL;
+
+               ddata->poll_enter_rate = 0;
+               apci_poll_stop(ddata);
+
+               ddata->poll_exit_rate = settings.exit_rate;
+               ddata->poll_interval_ns = (u64)settings.interval_us * NSEC_PER_USEC;
+               spin_lock_irqsave(&(ddata->irq_lock), flags);
+               ddata->rate_window_events = 0;
+               ddata->rate_window_start = ktime_get_ns();
+               spin_unlock_irqrestore(&(ddata->irq_lock), flags);
+               ddata->poll_enter_rate = settings.enter_rate;
+               apci_debug("poll settings: enter %u/s, exit %u/s, interval %u us\n",
+                          settings.enter_rate, settings.exit_rate, settings.interval_us);
+          }
+          break;
+
+     case apci_get_poll_stats:
+          {
+               poll_stats_t stats = {0};
+
+               stats.mode = READ_ONCE(ddata->poll_mode);
+               stats.event_rate = READ_ONCE(ddata->event_rate);
+               stats.mode_switches = ddata->poll_mode_switches;
+               stats.irq_events = ddata->irq_events;
+               stats.polled_events = ddata->polled_events;
+
+               status = copy_to_user((poll_stats_t *) arg, &stats, sizeof(poll_stats_t));
+               if (status) return -EFAULT;
+          }
+          break;
+
+     case apci_set_coalesce:
+          {
+               coalesce_settings_t settings;
+
+               status = copy_from_user(&settings, (coalesce_settings_t *) arg,
+                                       sizeof(coalesce_settings_t));
+               if (status) return -EFAULT;
+
+               apci_set_coalescing(ddata, settings.frames, settings.usecs);
+          }
+          break;
+
+     case apci_get_coalesce_stats:
+          {
+               coalesce_stats_t stats;
+
+               spin_lock_irqsave(&(ddata->coalesce_lock), flags);
+               stats = ddata->coalesce_stats;
+               spin_unlock_irqrestore(&(ddata->coalesce_lock), flags);
+
+               status = copy_to_user((coalesce_stats_t *) arg, &stats, sizeof(coalesce_stats_t));
+               if (status) return -EFAULT;
+          }
+          break;
+
+     case apci_set_rearm:
+          {
+               rearm_settings_t settings;
+
+               status = copy_from_user(&settings, (rearm_settings_t *) arg,
+                                       sizeof(rearm_settings_t));
+               if (status) return -EFAULT;
+
+               return apci_set_rearm_policy(ddata, settings.enable, settings.mask);
+          }
+
+     case apci_set_debounce:
+          return apci_set_debounce_window(ddata, arg);
+
+     case apci_get_debounce_stats:
+          {
+               debounce_stats_t stats;
+
+               /* a consistent snapshot, the ISR and timer update it */
+               spin_lock_irqsave(&(ddata->irq_lock), flags);
+               stats = ddata->debounce_stats;
+               spin_unlock_irqrestore(&(ddata->irq_lock), flags);
+               status = copy_to_user((debounce_stats_t *) arg, &stats, sizeof(debounce_stats_t));
+               if (status) return -EFAULT;
+          }
+          break;
+
+     case apci_get_edge_counters:
+          {
+               edge_counters_t *edges;
+
+               if (ddata->edge_counters == NULL) return -EOPNOTSUPP;
+
+               edges = kmalloc(sizeof(edge_counters_t), GFP_KERNEL);
+               if (edges == NULL) return -ENOMEM;
+
+               spin_lock_irqsave(&(ddata->status_lock), flags);
+               memcpy(edges, ddata->edge_counters, sizeof(edge_counters_t));
+               spin_unlock_irqrestore(&(ddata->status_lock), flags);
+
+               status = copy_to_user((edge_counters_t *) arg, edges, sizeof(edge_counters_t));
+               kfree(edges);
+               if (status) return -EFAULT;
+          }
+          break;
+
+     case apci_reset_edge_counters:
+          if (ddata->edge_counters == NULL) return -EOPNOTSUPP;
+          apci_reset_edges(ddata);
+          break;
+
+     case apci_quad_read:
+          {
+               quad_state_t *quad;
+
+               if (ddata->quad == NULL) return -EOPNOTSUPP;
+
+               quad = kmalloc(sizeof(quad_state_t), GFP_KERNEL);
+               if (quad == NULL) return -ENOMEM;
+
+               apci_quad_sample(ddata, 0, apci_quad_channels(ddata));
+               spin_lock_irqsave(&(ddata->quad_lock), flags);
+               memcpy(quad, ddata->quad, sizeof(quad_state_t));
+               spin_unlock_irqrestore(&(ddata->quad_lock), flags);
+
+               status = copy_to_user((quad_state_t *) arg, quad, sizeof(quad_state_t));
+               kfree(quad);
+               if (status) return -EFAULT;
+          }
+          break;
+
+     case apci_quad_velocity_rate:
+          if (ddata->quad == NULL) return -EOPNOTSUPP;
+          if (arg > 100000) return -EINVAL;
+          apci_quad_set_velocity_rate(ddata, arg);
+          break;
+
+     case apci_wdt_keepalive:
+          {
+               wdt_keepalive_t keepalive;
+
+               status = copy_from_user(&keepalive, (wdt_keepalive_t *) arg, sizeof(wdt_keepalive_t));
+               if (status) return -EFAULT;
+               return apci_wdt_set_keepalive(ddata, &keepalive);
+          }
+
+     case apci_wdt_heartbeat_ioctl:
+          return apci_wdt_heartbeat(ddata);
+
+     case apci_set_dma_user_buffer:
+          {
+               dma_user_buffer_t buffer;
+
+               status = copy_from_user(&buffer, (dma_user_buffer_t *) arg, sizeof(dma_user_buffer_t));
+               if (status) return -EFAULT;
+
+               status = apci_dmabuf_lock_buffer(ddata, APCI_DMABUF_RING);
+               if (status) return status;
+               mutex_lock(&ddata->read_lock);
+               apci_level_reset(ddata);
+               WRITE_ONCE(ddata->fifo_drain_words, 0);
+               apci_dma_free_ring(ddata);
+               if (buffer.addr != 0)
+               {
+                    status = apci_dma_map_user(ddata, &buffer);
+                    if (status == 0)
+                         apci_dma_rewind(ddata);
+               }
+               mutex_unlock(&ddata->read_lock);
+               apci_dmabuf_unlock_buffer();
+               if (status) return status;
+          }
+          break;
+
+     case apci_set_dma_ring_mode:
+          if (!apci_is_dma_capable(ddata)) return -EOPNOTSUPP;
+          if (arg > APCI_DMA_NONCOHERENT) return -EINVAL;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+          if (arg == APCI_DMA_NONCOHERENT) return -EOPNOTSUPP;
+#endif
+          ddata->dma_noncoherent = arg;
+          break;
+
+     case apci_set_dma_ring_policy:
+          if (arg > APCI_RING_OVERWRITE_OLDEST) return -EINVAL;
+          spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+          ddata->dma_ring_policy = arg;
+          spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+          break;
+
+     case apci_set_dma_latency:
+          {
+               dma_latency_t lat;
+
+               status = copy_from_user(&lat, (dma_latency_t *)arg, sizeof(dma_latency_t));
+               if (status) return -EFAULT;
+               status = apci_set_dma_latency_cfg(ddata, &lat);
+               if (status) return status;
+               status = copy_to_user((dma_latency_t *)arg, &lat, sizeof(dma_latency_t));
+               if (status) return -EFAULT;
+          }
+          break;
+
+     case apci_get_dma_latency:
+          {
+               dma_latency_t lat;
+
+               spin_lock_irqsave(&(ddata->dma_data_lock), flags);
+               lat = ddata->dma_latency;
+               spin_unlock_irqrestore(&(ddata->dma_data_lock), flags);
+               status = copy_to_user((dma_latency_t *)arg, &lat, sizeof(dma_latency_t));
+               if (status) return -EFAULT;
+          }
+          break;
+
+     case apci_export_dmabuf:
+          return apci_dmabuf_export(ddata, arg);
+
+     case apci_flush_dma_ring:
+          return apci_dma_flush(ddata);
+
+     case apci_set_dma_flush_timeout:
+          return apci_dma_set_flush_timeout(ddata, arg);
+
+     case apci_set_dma_cursor:
+          return apci_set_cursor_mode(file, arg);
+
+     case apci_reset_dma_ring:
+          status = 0;
+          mutex_lock(&ddata->read_lock);
+          if (ddata->dma_virt_addr == NULL)
+               status = -ENODEV;
+          else
+               apci_dma_rewind(ddata);
+          mutex_unlock(&ddata->read_lock);
+          if (status) return status;
+          break;
+
+     case apci_set_fifo_drain:
+          {
+               fifo_drain_t drain;
+
+               status = copy_from_user(&drain, (fifo_drain_t *) arg, sizeof(fifo_drain_t));
+               if (status) return -EFAULT;
+               mutex_lock(&ddata->read_lock);
+               status = apci_set_fifo_drain_cfg(ddata, &drain);
+               mutex_unlock(&ddata->read_lock);
+               return status;
+          }
+
+     case apci_set_level_trigger:
+          {
+               level_trigger_t level;
+
+               status = copy_from_user(&level, (level_trigger_t *) arg, sizeof(level_trigger_t));
+               if (status) return -EFAULT;
+               return apci_set_level_trigger_cfg(ddata, &level);
+          }
+
+     case apci_get_level_crossing:
+          {
+               level_crossing_t crossing;
+
+               spin_lock_irqsave(&(ddata->level_lock), flags);
+               crossing = ddata->level_crossing;
+               spin_unlock_irqrestore(&(ddata->level_lock), flags);
+
+               status = copy_to_user((level_crossing_t *) arg, &crossing, sizeof(level_crossing_t));
+               if (status) return -EFAULT;
+          }
+          break;
+
+     case apci_set_action:
+          {
+               action_rule_t rule;
+               int i;
+
+               status = copy_from_user(&rule, (action_rule_t *) arg, sizeof(action_rule_t));
+               if (status) return -EFAULT;
+
+               if (rule.enable)
+               {
+                    if (rule.source == APCI_ACTION_SRC_REGISTER)
+                    {
+                         if (!action_addr_ok(ddata, rule.bar, rule.offset, rule.size)) return -EINVAL;
+                    }
+                    else if (rule.source != APCI_ACTION_SRC_STATUS)
+                    {
+                         return -EINVAL;
+                    }
+
+                    for (i = 0; i < APCI_ACTION_OPS && rule.ops[i].opcode != APCI_ACTION_END; i++)
+                    {
+                         if (rule.ops[i].opcode > APCI_ACTION_READ) return -EINVAL;
+                         if (!action_addr_ok(ddata, rule.ops[i].bar, rule.ops[i].offset, rule.ops[i].size))
+                              return -EINVAL;
+                    }
+               }
+               return apci_set_action_rule(ddata, &rule);
+          }
+
+     case apci_set_irq_affinity:
+          return apci_set_irq_affinity_cpu(ddata, (long)arg);
+
+     case apci_get_irq_info:
+          {
+               irq_info_t irq_info;
+
+               irq_info.irq = ddata->irq_capable ? ddata->irq : -1;
+               irq_info.numa_node = dev_to_node(&(ddata->pci_dev->dev));
+               irq_info.affinity_cpu = ddata->irq_affinity_cpu;
+
+               status = copy_to_user((irq_info_t *) arg, &irq_info, sizeof(irq_info_t));
+               if (status) return -EFAULT;
           }
           break;
     };
@@ -540,9 +1281,27 @@ long  ioctl_apci(struct file *filp, unsigned int cmd, unsigned long arg)
 }
 
 
+/* Map one driver-owned page read-only into userspace. */
+static int mmap_apci_page_ro(struct vm_area_struct *vma, void *page)
+{
+     if (page == NULL) return -ENODEV;
+     if ((vma->vm_flags & VM_WRITE) || (vma->vm_end - vma->vm_start > PAGE_SIZE))
+          return -EINVAL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+     vm_flags_clear(vma, VM_MAYWRITE);
+#else
+     vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+     return remap_pfn_range(vma,
+               vma->vm_start,
+               virt_to_phys(page) >> PAGE_SHIFT,
+               vma->vm_end - vma->vm_start,
+               vma->vm_page_prot);
+}
+
 int mmap_apci (struct file *filp, struct vm_area_struct *vma)
 {
-     struct apci_my_info *ddata = filp->private_data;
+     struct apci_my_info *ddata = ((struct apci_file *)filp->private_data)->ddata;
      int status;
      unsigned long pfn_start;
 
@@ -551,6 +1310,17 @@ int mmap_apci (struct file *filp, struct vm_area_struct *vma)
      switch (vma->vm_pgoff)
      {
      case 0: //default for DMA
+          if (ddata->dma_user_pages != NULL) return -EINVAL; //the user owns it already
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+          if (ddata->dma_pages != NULL)
+          {
+               status = dma_mmap_pages(&(ddata->pci_dev->dev),
+                         vma,
+                         vma->vm_end - vma->vm_start,
+                         ddata->dma_pages);
+               break;
+          }
+#endif
           status = dma_mmap_coherent(&(ddata->pci_dev->dev),
                     vma,
                     ddata->dma_virt_addr,
@@ -565,6 +1335,36 @@ int mmap_apci (struct file *filp, struct vm_area_struct *vma)
                     vma->vm_end - vma->vm_start,
                     vma->vm_page_prot);
           break;
+     case APCI_MMAP_STATUS: //read-only status page
+          status = mmap_apci_page_ro(vma, ddata->status_page);
+          break;
+     case APCI_MMAP_EDGES: //read-only edge counters
+          status = mmap_apci_page_ro(vma, ddata->edge_counters);
+          break;
+     case APCI_MMAP_QUAD: //read-only quadrature positions and velocities
+          status = mmap_apci_page_ro(vma, ddata->quad);
+          break;
+     case APCI_MMAP_RING: //read-write ring indices
+          if (vma->vm_end - vma->vm_start > PAGE_SIZE) return -EINVAL;
+          status = remap_pfn_range(vma,
+                    vma->vm_start,
+                    virt_to_phys(ddata->ring_ctl) >> PAGE_SHIFT,
+                    PAGE_SIZE,
+                    vma->vm_page_prot);
+          break;
+     case APCI_MMAP_SLOT_META: //read-only per-slot metadata
+          if (ddata->dma_slot_meta == NULL) return -ENODEV;
+          if (vma->vm_flags & VM_WRITE) return -EINVAL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+          vm_flags_clear(vma, VM_MAYWRITE);
+#else
+          vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+          status = remap_vmalloc_range(vma, ddata->dma_slot_meta, 0);
+          break;
+     case APCI_MMAP_ACTIONS: //read-only action log
+          status = mmap_apci_page_ro(vma, ddata->action_log);
+          break;
      default:
           //complain and return error
           break;
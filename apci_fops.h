@@ -3,6 +3,7 @@
 
 #include <linux/types.h>
 #include <linux/kernel.h>
+#include <linux/poll.h>
 #include <linux/sched.h>
 #include <linux/version.h>
 #include <asm/io.h>
@@ -17,7 +18,14 @@ typedef struct inode* pInode;
 typedef struct file* pFile;
 
 ssize_t read_apci(struct file *f, char __user *buf, size_t len, loff_t *off);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+ssize_t read_iter_apci(struct kiocb *iocb, struct iov_iter *to);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+__poll_t poll_apci(struct file *filp, poll_table *wait);
+#endif
 int open_apci( pInode inode, pFile filp );
+int release_apci( pInode inode, pFile filp );
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,39)
 int ioctl_apci(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg);
 #else
@@ -33,6 +33,16 @@ typedef struct
         unsigned long base_addresses[6];
 } info_struct;
 
+/* mmap() offsets, in pages */
+#define APCI_MMAP_DMA 0
+#define APCI_MMAP_DAC 1
+#define APCI_MMAP_STATUS 2
+#define APCI_MMAP_EDGES 3
+#define APCI_MMAP_QUAD 4
+#define APCI_MMAP_ACTIONS 5
+#define APCI_MMAP_RING 6
+#define APCI_MMAP_SLOT_META 7
+
 #define APCI_EVENT_DATA_READY 0x1
 #define APCI_EVENT_DATA_DISCARDED 0x2
 
@@ -47,6 +57,358 @@ typedef struct {
                             //full buffer since last call to data_ready
 } data_ready_t;
 
+/* apci_wait_for_data: release release_slots consumed slots, then block until
+ * at least min_slots slots are ready or timeout_ms expires (0 = no timeout).
+ * With the level trigger enabled it also waits for a crossing after the
+ * call started. ready is filled in either way; on timeout the ioctl fails with ETIMEDOUT
+ * and the data_discarded it reports is handed over again by the next call.
+ */
+typedef struct {
+        __u32 min_slots;
+        __u32 timeout_ms;
+        __u32 release_slots;
+        data_ready_t ready;
+} dma_wait_t;
+
+/* Adaptive IRQ/polling for AxIO cards. When the event rate rises above
+ * enter_rate (events/s) the card's IRQ is masked and the driver polls it
+ * every interval_us; when the rate falls below exit_rate IRQs are restored.
+ * While polling at most one event is serviced per interval, so interval_us
+ * must be shorter than one DMA slot fill time and exit_rate must be below
+ * 1000000 / interval_us. enter_rate == 0 disables polling.
+ */
+typedef struct {
+        __u32 enter_rate;
+        __u32 exit_rate;
+        __u32 interval_us;
+} poll_settings_t;
+
+typedef struct {
+        __u32 mode; //0 = IRQ, 1 = polling
+        __u32 event_rate; //events/s over the last measurement window
+        __u64 mode_switches;
+        __u64 irq_events;
+        __u64 polled_events;
+} poll_stats_t;
+
+/* Read-only page at mmap offset APCI_MMAP_STATUS, updated by the ISR on
+ * every event. seq is odd while an update is in progress; readers retry
+ * until they see the same even seq before and after copying the fields.
+ */
+typedef struct {
+        __u32 seq;
+        __u32 last_status; //raw IRQ status register of the last event
+        __u64 event_count;
+        __u64 last_event_ns; //CLOCK_MONOTONIC
+        __s32 dma_last_buffer;
+        __s32 dma_first_valid;
+        __u32 dma_data_discarded; //slots discarded since the ring was set up
+} status_page_t;
+
+/* Wakeup coalescing: wake waiters once frames events are pending, or usecs
+ * after the first pending event, whichever comes first. 0 disables a limit;
+ * both 0 wakes on every event.
+ */
+typedef struct {
+        __u32 frames;
+        __u32 usecs;
+} coalesce_settings_t;
+
+#define APCI_COALESCE_BUCKETS 8
+typedef struct {
+        __u64 events;
+        __u64 wakeups;
+        __u32 max_events_per_wakeup;
+        __u32 histogram[APCI_COALESCE_BUCKETS]; //[i]: wakeups delivering 2^i..2^(i+1)-1 events
+} coalesce_stats_t;
+
+/* Automatic IRQ re-arm for cards whose ISR has to disable the IRQ
+ * (PCI/PCIe-DIO-72/96/120: +0x1e/+0x1f, PCI-AI12-16 family: +0x4).
+ * mask holds the enable byte(s) to restore after each event, low byte
+ * first; later apci_write8/16 calls to those registers update it.
+ */
+typedef struct {
+        __u32 enable;
+        __u32 mask;
+} rearm_settings_t;
+
+/* Change-of-state debounce (PCI/PCIe-IIRO-8/16, mPCIe-II-16/8/4): on the
+ * first edge CoS IRQs are masked and the inputs are re-sampled usecs later;
+ * an event is only delivered if the sampled state differs from the last
+ * delivered one. The status page is then only updated for delivered
+ * events, with the sampled state as last_status instead of the raw IRQ
+ * status; filtered edges only show in edges/suppressed. On the mPCIe-II
+ * cards the mask (+40) covers every input, so the window holds off CoS
+ * IRQs for the whole card, not just the input that bounced.
+ */
+typedef struct {
+        __u64 edges; //CoS IRQs seen
+        __u64 events; //filtered events delivered
+        __u64 suppressed; //windows that ended with no change
+        __u32 state; //last delivered input state
+} debounce_stats_t;
+
+/* Per-bit CoS edge counters (PCIe-IDIO-12/24), updated by the ISR from the
+ * CoS latch at +8 and readable with apci_get_edge_counters or read-only at
+ * mmap offset APCI_MMAP_EDGES (same seq protocol as status_page_t). A bit
+ * that latched without changing level counts as one rising and one falling
+ * edge; edges closer together than the IRQ latency are not counted.
+ */
+#define APCI_EDGE_BITS 32
+typedef struct {
+        __u32 seq;
+        __u32 state; //input levels (+4) at the last CoS IRQ
+        __u64 rising[APCI_EDGE_BITS];
+        __u64 falling[APCI_EDGE_BITS];
+        __u64 last_edge_ns[APCI_EDGE_BITS]; //CLOCK_MONOTONIC
+} edge_counters_t;
+
+/* Quadrature counters (mPCIe/PCI-QUAD-4/8) extended to 64 bits by the
+ * driver. Positions are refreshed by apci_quad_read (all channels latched
+ * back to back), by carry/borrow IRQs and by the velocity timer; velocity is
+ * only computed by the timer, see apci_quad_velocity_rate. Readable
+ * read-only at mmap offset APCI_MMAP_QUAD (same seq protocol as
+ * status_page_t). Writing a counter reset (bit 0 of +6) zeroes the position.
+ */
+#define APCI_QUAD_CHANNELS 8
+typedef struct {
+        __u32 seq;
+        __u32 velocity_hz;
+        __u64 timestamp_ns; //CLOCK_MONOTONIC, when the channels were latched
+        __s64 position[APCI_QUAD_CHANNELS];
+        __s64 velocity[APCI_QUAD_CHANNELS]; //counts/s over the last timer period
+} quad_state_t;
+
+/* In-driver keepalive for the WDG cards' /dev/watchdogN: the driver pings
+ * the hardware every ping_ms for as long as the last heartbeat (the
+ * apci_wdt_heartbeat ioctl or a WDIOC_KEEPALIVE) is at most heartbeat_ms
+ * old. ping_ms = 0 turns it off.
+ */
+typedef struct {
+        __u32 ping_ms;
+        __u32 heartbeat_ms;
+} wdt_keepalive_t;
+
+/* Event-to-action rules, run by the threaded IRQ handler for every event
+ * the driver delivers (from the ISR, poll mode, the debounce timer or a
+ * level crossing; after debounce/coalescing decisions, before any
+ * re-arm). A rule fires when (status & mask) == match, where status is
+ * either the word published with that event in status_page_t.last_status
+ * or a register read at that point. Its program runs ops in order up to the
+ * first APCI_ACTION_END. Every firing is appended to the action log,
+ * mappable read-only at APCI_MMAP_ACTIONS once a rule has been set.
+ */
+#define APCI_ACTION_RULES 8
+#define APCI_ACTION_OPS 8
+
+#define APCI_ACTION_SRC_STATUS 0
+#define APCI_ACTION_SRC_REGISTER 1
+
+#define APCI_ACTION_END 0
+#define APCI_ACTION_WRITE 1  //write value
+#define APCI_ACTION_MODIFY 2 //replace the bits in mask with value
+#define APCI_ACTION_READ 3   //snapshot into the log entry
+
+typedef struct {
+        __u8 opcode;
+        __u8 bar;
+        __u8 size; //enum SIZE
+        __u8 reserved;
+        __u32 offset;
+        __u32 value;
+        __u32 mask;
+} action_op_t;
+
+typedef struct {
+        __u32 index; //0 .. APCI_ACTION_RULES - 1
+        __u32 enable; //0 removes the rule
+        __u8 source;
+        __u8 bar; //APCI_ACTION_SRC_REGISTER only
+        __u8 size;
+        __u8 reserved;
+        __u32 offset;
+        __u32 mask;
+        __u32 match;
+        action_op_t ops[APCI_ACTION_OPS];
+} action_rule_t;
+
+typedef struct {
+        __u64 irq_ns; //CLOCK_MONOTONIC, when the ISR took the event
+        __u64 done_ns; //when the program finished
+        __u32 rule;
+        __u32 status;
+        __u32 reads[APCI_ACTION_OPS]; //per op: value read by READ/MODIFY
+} action_log_entry_t;
+
+#define APCI_ACTION_LOG_ENTRIES 64
+typedef struct {
+        __u32 head; //entries written so far, entry n is at n % APCI_ACTION_LOG_ENTRIES
+        __u32 reserved;
+        action_log_entry_t entries[APCI_ACTION_LOG_ENTRIES];
+} action_log_t;
+
+/* Level trigger on AxIO DMA data: each completed slot is scanned for
+ * samples of channel (status word bits 4..7) crossing threshold, and the
+ * event (wait_for_irq, apci_wait_for_data, status page) only fires when
+ * one is found. read(), poll() and apci_data_ready still see every slot
+ * as it completes. The last crossing is read back with
+ * apci_get_level_crossing.
+ */
+#define APCI_LEVEL_RISING 1
+#define APCI_LEVEL_FALLING 2
+#define APCI_LEVEL_BOTH (APCI_LEVEL_RISING | APCI_LEVEL_FALLING)
+
+typedef struct {
+        __u32 enable;
+        __u32 channel;
+        __s32 threshold; //a sample crosses when it goes from <= to > threshold or back
+        __u32 direction; //APCI_LEVEL_*
+} level_trigger_t;
+
+typedef struct {
+        __u32 count; //crossings since the trigger was set
+        __u32 slot; //of the last crossing
+        __u32 sample; //index into that slot, in 32-bit samples
+        __s32 value;
+        __u32 direction; //APCI_LEVEL_RISING or APCI_LEVEL_FALLING
+        __u32 slots_scanned;
+        __u64 timestamp_ns; //CLOCK_MONOTONIC, when the slot was scanned
+} level_crossing_t;
+
+/* Kernel FIFO drain (PCI-AI12-16 family, LPCI-A16-16A): on each FIFO
+ * interrupt the driver reads words_per_irq 16-bit samples into the ring
+ * set up with apci_set_dma_transfer_size and re-enables the FIFO IRQ, so
+ * the data is consumed exactly like DMA data (mmap offset 0, data_ready,
+ * apci_wait_for_data). words_per_irq should match the FIFO level the card
+ * interrupts at; the FIFO IRQ enables must be written through the driver so
+ * it can restore them. enable = 0 returns to the disable-on-IRQ behaviour.
+ */
+#define APCI_FIFO_DRAIN_MAX_WORDS 4096
+typedef struct {
+        __u32 enable;
+        __u32 words_per_irq;
+} fifo_drain_t;
+
+/* DMA ring indices as a single-producer/single-consumer pair, mappable
+ * read-write at APCI_MMAP_RING. Both indices count up modulo index_wrap,
+ * a multiple of num_slots (slot = index % num_slots, and the distance
+ * from a to b is (b + index_wrap - a) % index_wrap): the driver advances
+ * producer with release semantics as each slot completes, the consumer
+ * advances consumer with release semantics once done with slots, and the
+ * slots from consumer up to producer are ready. When the
+ * ring policy overwrites the oldest slot the driver advances oldest
+ * instead; a consumer behind oldest has lost the slots in between and
+ * picks up at oldest (apci_ring_peek does this). The data_ready/data_done
+ * ioctls stay valid and move the same indices, but a consumer should use
+ * one or the other. Reset by apci_set_dma_transfer_size.
+ */
+typedef struct {
+        __u32 producer; //written by the driver
+        __u32 num_slots;
+        __u32 slot_size;
+        __u32 overruns; //slots overwritten because the ring was full
+        __u32 oldest; //written by the driver: first slot not overwritten
+        __u32 index_wrap; //indices run modulo this, a multiple of num_slots
+        __u8 reserved0[64 - 24];
+        __u32 consumer; //written by the user
+        __u8 reserved1[64 - 4];
+} dma_ring_ctl_t;
+
+/* Use a user buffer (ideally hugepage-backed) as the DMA ring instead of
+ * the driver's coherent allocation. The buffer is pinned for as long as
+ * it is the ring; every slot must be physically contiguous, which slots
+ * inside one (huge)page always are. Everything else (data_ready, ring
+ * indices, read()) works as with apci_set_dma_transfer_size, except
+ * mmap offset 0. addr = 0 releases the ring.
+ */
+typedef struct {
+        __u64 addr;
+        __u32 num_slots;
+        __u32 slot_size;
+} dma_user_buffer_t;
+
+/* Memory for the rings apci_set_dma_transfer_size allocates from then on.
+ * APCI_DMA_NONCOHERENT gives normal cached memory: the driver syncs each
+ * slot for the CPU as it completes and for the device as it is handed back
+ * to the DMA engine, so consumers (mmap, read()) parse at full speed.
+ */
+#define APCI_DMA_COHERENT 0
+#define APCI_DMA_NONCOHERENT 1
+
+/* Per-slot metadata, an array of num_slots entries parallel to the DMA ring
+ * and mappable read-only at APCI_MMAP_SLOT_META. An entry is written when
+ * its slot completes, before the slot is published to the consumer.
+ */
+#define APCI_SLOT_AFTER_OVERRUN 0x1 //slots were discarded right before this one
+#define APCI_SLOT_PARTIAL 0x2 //bytes < slot_size: short transfer or flushed tail
+
+typedef struct {
+        __u64 timestamp_ns; //CLOCK_MONOTONIC, when the slot completed
+        __u64 seq; //slots completed since the ring was (re)set, discarded ones included, so gaps mean discards
+        __u32 fifo_level; //FIFO depth register (+0x28) at completion
+        __u32 flags; //APCI_SLOT_*
+        __u32 bytes; //valid bytes in the slot
+        __u32 reserved;
+} slot_meta_t;
+
+/* What the ISR does when the DMA ring is full. DROP_NEWEST keeps the
+ * unread data and rewrites the newest slot; OVERWRITE_OLDEST keeps
+ * acquiring and moves dma_ring_ctl_t.oldest (and dma_first_valid) past
+ * the oldest slot itself, for flight-recorder use. Either way the lost slots
+ * are counted in data_discarded and dma_ring_ctl_t.overruns.
+ */
+#define APCI_RING_DROP_NEWEST 0
+#define APCI_RING_OVERWRITE_OLDEST 1
+
+/* Per-open-file DMA cursors. By default a file consumes the ring through
+ * the shared consumer index (data_ready, data_done, read() and the mapped
+ * dma_ring_ctl_t all move the same cursor). A file switched to LOSSLESS or
+ * LOSSY gets its own cursor instead: data_ready, data_done, wait_for_data
+ * and read() on that file only see and move that cursor, and
+ * data_discarded counts what that file missed. The ISR only holds back for
+ * the slowest LOSSLESS cursor (subject to the ring policy); LOSSY cursors
+ * that fall a ring behind skip to the oldest intact slot. While any file
+ * has its own cursor the driver owns dma_ring_ctl_t.consumer, so the
+ * shared cursor must not be used at the same time.
+ */
+#define APCI_CURSOR_SHARED 0
+#define APCI_CURSOR_LOSSLESS 1
+#define APCI_CURSOR_LOSSY 2
+
+/* apci_export_dmabuf returns a dma-buf fd for the DMA ring or the DAC
+ * staging buffer (mmap offset 1). The fd can be passed to another process
+ * over a UNIX socket and mmap'd there. While it is open the buffer cannot
+ * be resized or replaced (-EBUSY). User-buffer rings cannot be exported.
+ */
+#define APCI_DMABUF_RING 0
+#define APCI_DMABUF_DAC 1
+
+/* Size AxIO DMA transfers for a delivery latency instead of whole slots.
+ * The FIFO-almost-full threshold (+0x20) and the bytes moved into each
+ * slot are set to the FIFO entries (8 bytes, one conversion from each ADC)
+ * that accumulate in latency_us, limited to 1..0xFFF entries and to the
+ * ring's slot size. With sample_hz 0 the entry rate is the card's base
+ * clock (+0x0C) over its divisor (+0x10), and the sizing is redone every
+ * time the divisor is written through the driver. Slots then hold fewer
+ * bytes than slot_size: see slot_meta_t.bytes. latency_us 0 goes back to
+ * whole-slot transfers; the FAF threshold is then the user's again.
+ */
+typedef struct {
+        __u32 sample_hz; //per-channel rate, 0 = follow the card's divisor
+        __u32 channels; //channels scanned per ADC, when sample_hz is set
+        __u32 latency_us; //target delivery latency, 0 = whole slots
+        __u32 faf_threshold; //out: FIFO entries per slot
+        __u32 slot_bytes; //out: bytes moved per slot
+        __u32 irq_rate_milli_hz; //out: slots (IRQs) per 1000 s
+        __u32 achieved_us; //out: time to fill one slot
+} dma_latency_t;
+
+typedef struct {
+        __s32 irq;
+        __s32 numa_node; //-1 if the platform doesn't report one
+        __s32 affinity_cpu; //CPU the IRQ is steered to, -1 if not set
+} irq_info_t;
+
 
 
 
@@ -63,6 +425,43 @@ typedef struct {
 #define apci_data_done              _IOW(ACCES_MAGIC_NUM, 11, unsigned long)
 #define apci_write_buff_ioctl       _IOW(ACCES_MAGIC_NUM, 12, buff_iopack *)
 #define apci_set_dac_buff_size     _IOW(ACCES_MAGIC_NUM, 13, unsigned long)
+#define apci_set_poll_settings      _IOW(ACCES_MAGIC_NUM, 14, poll_settings_t *)
+#define apci_get_poll_stats         _IOR(ACCES_MAGIC_NUM, 15, poll_stats_t *)
+#define apci_set_irq_affinity       _IOW(ACCES_MAGIC_NUM, 16, long)
+#define apci_get_irq_info           _IOR(ACCES_MAGIC_NUM, 17, irq_info_t *)
+#define apci_wait_for_data          _IOWR(ACCES_MAGIC_NUM, 18, dma_wait_t *)
+#define apci_set_coalesce           _IOW(ACCES_MAGIC_NUM, 19, coalesce_settings_t *)
+#define apci_get_coalesce_stats     _IOR(ACCES_MAGIC_NUM, 20, coalesce_stats_t *)
+#define apci_set_rearm              _IOW(ACCES_MAGIC_NUM, 21, rearm_settings_t *)
+#define apci_set_debounce           _IOW(ACCES_MAGIC_NUM, 22, unsigned long)
+#define apci_get_debounce_stats     _IOR(ACCES_MAGIC_NUM, 23, debounce_stats_t *)
+#define apci_get_edge_counters      _IOR(ACCES_MAGIC_NUM, 24, edge_counters_t *)
+#define apci_reset_edge_counters    _IO(ACCES_MAGIC_NUM, 25)
+#define apci_quad_read              _IOR(ACCES_MAGIC_NUM, 26, quad_state_t *)
+#define apci_quad_velocity_rate     _IOW(ACCES_MAGIC_NUM, 27, unsigned long)
+#define apci_wdt_keepalive          _IOW(ACCES_MAGIC_NUM, 28, wdt_keepalive_t *)
+#define apci_wdt_heartbeat_ioctl    _IO(ACCES_MAGIC_NUM, 29)
+#define apci_set_action             _IOW(ACCES_MAGIC_NUM, 30, action_rule_t *)
+#define apci_set_level_trigger      _IOW(ACCES_MAGIC_NUM, 31, level_trigger_t *)
+#define apci_get_level_crossing     _IOR(ACCES_MAGIC_NUM, 32, level_crossing_t *)
+#define apci_set_fifo_drain         _IOW(ACCES_MAGIC_NUM, 33, fifo_drain_t *)
+#define apci_set_dma_user_buffer    _IOW(ACCES_MAGIC_NUM, 34, dma_user_buffer_t *)
+#define apci_reset_dma_ring         _IO(ACCES_MAGIC_NUM, 35)
+#define apci_set_dma_ring_mode      _IOW(ACCES_MAGIC_NUM, 36, unsigned long)
+#define apci_set_dma_ring_policy    _IOW(ACCES_MAGIC_NUM, 37, unsigned long)
+#define apci_set_dma_cursor         _IOW(ACCES_MAGIC_NUM, 38, unsigned long)
+#define apci_set_dma_latency        _IOWR(ACCES_MAGIC_NUM, 39, dma_latency_t *)
+#define apci_get_dma_latency        _IOR(ACCES_MAGIC_NUM, 40, dma_latency_t *)
+/* apci_flush_dma_ring hands the samples still short of a full slot to the
+ * consumer as an APCI_SLOT_PARTIAL slot, e.g. after acquisition stops.
+ * apci_set_dma_flush_timeout (ms, 0 = off) does the same whenever no slot
+ * has completed for that long. Kernel FIFO drain mode only: elsewhere
+ * (AxIO DMA included) the driver cannot see how much of the transfer in
+ * flight has landed, and the ioctl fails with EOPNOTSUPP.
+ */
+#define apci_flush_dma_ring         _IO(ACCES_MAGIC_NUM, 41)
+#define apci_set_dma_flush_timeout  _IOW(ACCES_MAGIC_NUM, 42, unsigned long)
+#define apci_export_dmabuf          _IOW(ACCES_MAGIC_NUM, 43, unsigned long)
 
 
 
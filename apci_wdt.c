@@ -0,0 +1,250 @@
+#include <linux/watchdog.h>
+
+#include "apci_dev.h"
+
+/* PCI-WDG-2S/CSM/IMPAC: the watchdog is an 8254 at +0..+3. Counter 0
+ * divides the on-board clock down to 1 kHz and clocks counter 1, whose
+ * terminal count trips the watchdog outputs. Counter 2 is cascaded the same
+ * way and raises the card IRQ on CSM, which is used for the pretimeout.
+ * Reloading a mode 0 counter restarts it, writing only its control word
+ * halts it.
+ */
+#define WDG_CLOCK_HZ 2083333
+#define WDG_TICK_HZ 1000
+#define WDG_CTR0 0x0
+#define WDG_CTR1 0x1
+#define WDG_CTR2 0x2
+#define WDG_CONTROL 0x3
+#define WDG_CTR0_MODE2 0x34 /* counter 0, LSB then MSB, rate generator */
+#define WDG_CTR1_MODE0 0x70 /* counter 1, LSB then MSB, interrupt on terminal count */
+#define WDG_CTR2_MODE0 0xB0 /* counter 2, LSB then MSB, interrupt on terminal count */
+#define WDG_MAX_TIMEOUT (0xFFFF / WDG_TICK_HZ)
+#define WDG_DEFAULT_TIMEOUT 30
+
+#if IS_REACHABLE(CONFIG_WATCHDOG_CORE)
+
+static bool apci_wdt_is_wdg(struct apci_my_info *ddata)
+{
+  switch (ddata->dev_id)
+  {
+  case PCI_WDG_2S:
+  case PCI_WDG_CSM:
+  case PCI_WDG_IMPAC:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void apci_wdt_load(struct apci_my_info *ddata, int counter, unsigned int ms)
+{
+  outb(ms & 0xff, ddata->regions[2].start + counter);
+  outb((ms >> 8) & 0xff, ddata->regions[2].start + counter);
+}
+
+/* Restart the timeout (and pretimeout) counts. Caller holds wdt_lock. */
+static void apci_wdt_reload_locked(struct apci_my_info *ddata)
+{
+  struct watchdog_device *wdd = &ddata->wdd;
+
+  apci_wdt_load(ddata, WDG_CTR1, wdd->timeout * WDG_TICK_HZ);
+  if (wdd->pretimeout)
+    apci_wdt_load(ddata, WDG_CTR2, (wdd->timeout - wdd->pretimeout) * WDG_TICK_HZ);
+}
+
+static int apci_wdt_start(struct watchdog_device *wdd)
+{
+  struct apci_my_info *ddata = watchdog_get_drvdata(wdd);
+  unsigned long flags;
+
+  spin_lock_irqsave(&(ddata->wdt_lock), flags);
+  outb(WDG_CTR0_MODE2, ddata->regions[2].start + WDG_CONTROL);
+  apci_wdt_load(ddata, WDG_CTR0, WDG_CLOCK_HZ / WDG_TICK_HZ);
+  outb(WDG_CTR1_MODE0, ddata->regions[2].start + WDG_CONTROL);
+  outb(WDG_CTR2_MODE0, ddata->regions[2].start + WDG_CONTROL);
+  apci_wdt_reload_locked(ddata);
+  ddata->wdt_last_heartbeat = ktime_get_ns();
+  spin_unlock_irqrestore(&(ddata->wdt_lock), flags);
+  return 0;
+}
+
+static int apci_wdt_stop(struct watchdog_device *wdd)
+{
+  struct apci_my_info *ddata = watchdog_get_drvdata(wdd);
+  unsigned long flags;
+
+  spin_lock_irqsave(&(ddata->wdt_lock), flags);
+  outb(WDG_CTR1_MODE0, ddata->regions[2].start + WDG_CONTROL);
+  outb(WDG_CTR2_MODE0, ddata->regions[2].start + WDG_CONTROL);
+  spin_unlock_irqrestore(&(ddata->wdt_lock), flags);
+  return 0;
+}
+
+/* A ping through /dev/watchdogN also counts as the user's heartbeat. */
+static int apci_wdt_ping(struct watchdog_device *wdd)
+{
+  struct apci_my_info *ddata = watchdog_get_drvdata(wdd);
+  unsigned long flags;
+
+  spin_lock_irqsave(&(ddata->wdt_lock), flags);
+  apci_wdt_reload_locked(ddata);
+  ddata->wdt_last_heartbeat = ktime_get_ns();
+  spin_unlock_irqrestore(&(ddata->wdt_lock), flags);
+  return 0;
+}
+
+static int apci_wdt_set_timeout(struct watchdog_device *wdd, unsigned int timeout)
+{
+  wdd->timeout = timeout;
+  if (wdd->pretimeout >= timeout)
+    wdd->pretimeout = 0;
+  if (watchdog_active(wdd))
+    return apci_wdt_ping(wdd);
+  return 0;
+}
+
+static int apci_wdt_set_pretimeout(struct watchdog_device *wdd, unsigned int pretimeout)
+{
+  wdd->pretimeout = pretimeout;
+  if (watchdog_active(wdd))
+    return apci_wdt_ping(wdd);
+  return 0;
+}
+
+static const struct watchdog_info apci_wdt_info = {
+  .options = WDIOF_SETTIMEOUT | WDIOF_KEEPALIVEPING | WDIOF_MAGICCLOSE,
+  .identity = "ACCES PCI-WDG",
+};
+
+static const struct watchdog_info apci_wdt_info_pretimeout = {
+  .options = WDIOF_SETTIMEOUT | WDIOF_KEEPALIVEPING | WDIOF_MAGICCLOSE | WDIOF_PRETIMEOUT,
+  .identity = "ACCES PCI-WDG-CSM",
+};
+
+static const struct watchdog_ops apci_wdt_ops = {
+  .owner = THIS_MODULE,
+  .start = apci_wdt_start,
+  .stop = apci_wdt_stop,
+  .ping = apci_wdt_ping,
+  .set_timeout = apci_wdt_set_timeout,
+  .set_pretimeout = apci_wdt_set_pretimeout,
+};
+
+/* In-driver keepalive: ping the hardware every wdt_ping_ns for as long as
+ * the user's last heartbeat is younger than wdt_heartbeat_ns.
+ */
+static enum hrtimer_restart apci_wdt_timer_fn(struct hrtimer *timer)
+{
+  struct apci_my_info *ddata = container_of(timer, struct apci_my_info, wdt_timer);
+  unsigned long flags;
+
+  spin_lock_irqsave(&(ddata->wdt_lock), flags);
+  if (watchdog_active(&ddata->wdd) &&
+      ktime_get_ns() - ddata->wdt_last_heartbeat <= ddata->wdt_heartbeat_ns)
+    apci_wdt_reload_locked(ddata);
+  spin_unlock_irqrestore(&(ddata->wdt_lock), flags);
+
+  hrtimer_forward_now(timer, ns_to_ktime(ddata->wdt_ping_ns));
+  return HRTIMER_RESTART;
+}
+
+int apci_wdt_set_keepalive(struct apci_my_info *ddata, const wdt_keepalive_t *keepalive)
+{
+  if (!ddata->wdt_registered)
+    return -EOPNOTSUPP;
+
+  hrtimer_cancel(&ddata->wdt_timer);
+  if (keepalive->ping_ms == 0)
+    return 0;
+  if (keepalive->heartbeat_ms == 0 || keepalive->ping_ms >= ddata->wdd.timeout * MSEC_PER_SEC)
+    return -EINVAL;
+
+  ddata->wdt_ping_ns = (u64)keepalive->ping_ms * NSEC_PER_MSEC;
+  ddata->wdt_heartbeat_ns = (u64)keepalive->heartbeat_ms * NSEC_PER_MSEC;
+  apci_wdt_heartbeat(ddata);
+  hrtimer_start(&ddata->wdt_timer, ns_to_ktime(ddata->wdt_ping_ns), HRTIMER_MODE_REL);
+  return 0;
+}
+
+int apci_wdt_heartbeat(struct apci_my_info *ddata)
+{
+  if (!ddata->wdt_registered)
+    return -EOPNOTSUPP;
+
+  WRITE_ONCE(ddata->wdt_last_heartbeat, ktime_get_ns());
+  return 0;
+}
+
+/* Counter 2 reached terminal count on CSM: hand the pretimeout to the core. */
+void apci_wdt_irq(struct apci_my_info *ddata)
+{
+  if (ddata->wdt_registered && ddata->wdd.pretimeout && watchdog_active(&ddata->wdd))
+    watchdog_notify_pretimeout(&ddata->wdd);
+}
+
+int apci_wdt_register(struct apci_my_info *ddata)
+{
+  struct watchdog_device *wdd = &ddata->wdd;
+  int ret;
+
+  if (!apci_wdt_is_wdg(ddata))
+    return 0;
+
+  spin_lock_init(&(ddata->wdt_lock));
+  apci_hrtimer_setup(&ddata->wdt_timer, apci_wdt_timer_fn);
+
+  wdd->info = (ddata->dev_id == PCI_WDG_CSM && ddata->irq_capable) ?
+              &apci_wdt_info_pretimeout : &apci_wdt_info;
+  wdd->ops = &apci_wdt_ops;
+  wdd->parent = &ddata->pci_dev->dev;
+  wdd->min_timeout = 1;
+  wdd->max_timeout = WDG_MAX_TIMEOUT;
+  wdd->timeout = WDG_DEFAULT_TIMEOUT;
+  watchdog_init_timeout(wdd, 0, wdd->parent);
+  watchdog_set_drvdata(wdd, ddata);
+
+  ret = watchdog_register_device(wdd);
+  if (ret)
+    return ret;
+
+  ddata->wdt_registered = 1;
+  apci_info("registered watchdog%d\n", wdd->id);
+  return 0;
+}
+
+void apci_wdt_unregister(struct apci_my_info *ddata)
+{
+  if (!ddata->wdt_registered)
+    return;
+
+  hrtimer_cancel(&ddata->wdt_timer);
+  watchdog_unregister_device(&ddata->wdd);
+  ddata->wdt_registered = 0;
+}
+
+#else /* !CONFIG_WATCHDOG_CORE */
+
+int apci_wdt_set_keepalive(struct apci_my_info *ddata, const wdt_keepalive_t *keepalive)
+{
+  return -EOPNOTSUPP;
+}
+
+int apci_wdt_heartbeat(struct apci_my_info *ddata)
+{
+  return -EOPNOTSUPP;
+}
+
+void apci_wdt_irq(struct apci_my_info *ddata)
+{
+}
+
+int apci_wdt_register(struct apci_my_info *ddata)
+{
+  return 0;
+}
+
+void apci_wdt_unregister(struct apci_my_info *ddata)
+{
+}
+
+#endif
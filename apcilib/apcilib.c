@@ -21,10 +21,17 @@ For more information please contact the ACCES software department at
 (800)-326-1649 or visit www.accesio.com
 */
 
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <linux/errno.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "apcilib.h"
 #include "apci_ioctl.h"
@@ -197,7 +204,7 @@ int apci_cancel_irq(int fd, unsigned long device_index)
 	return ioctl(fd, apci_cancel_wait_ioctl, device_index);
 }
 
-int apci_dma_transfer_size(int fd, unsigned long device_index, __u8 num_slots, size_t slot_size)
+int apci_dma_transfer_size(int fd, unsigned long device_index, int num_slots, size_t slot_size)
 {
 	dma_buffer_settings_t settings;
 	settings.num_slots = num_slots;
@@ -223,7 +230,416 @@ int apci_dma_data_done(int fd, unsigned long device_index, int num_slots)
 	return ioctl(fd, apci_data_done, num_slots);
 }
 
+/* Release release_slots consumed slots, then block until at least min_slots
+ * are ready or timeout_ms expires (0 waits forever). One syscall per batch.
+ */
+int apci_dma_wait_for_data(int fd, unsigned long device_index, int min_slots, unsigned int timeout_ms, int release_slots, int *start_index, int *slots, int *data_discarded)
+{
+	int status;
+	dma_wait_t dma_wait = {0};
+	dma_wait.min_slots = min_slots;
+	dma_wait.timeout_ms = timeout_ms;
+	dma_wait.release_slots = release_slots;
+	status = ioctl(fd, apci_wait_for_data, &dma_wait);
+
+	*start_index = dma_wait.ready.start_index;
+	*slots = dma_wait.ready.slots;
+	*data_discarded = dma_wait.ready.data_discarded;
+
+	return status;
+}
+
 int apci_dac_buffer_size (int fd, unsigned long size)
 {
 	return ioctl(fd, apci_set_dac_buff_size, size);
 }
+
+int apci_set_polling(int fd, unsigned long device_index, __u32 enter_rate, __u32 exit_rate, __u32 interval_us)
+{
+	poll_settings_t settings;
+	settings.enter_rate = enter_rate;
+	settings.exit_rate = exit_rate;
+	settings.interval_us = interval_us;
+	return ioctl(fd, apci_set_poll_settings, &settings);
+}
+
+int apci_get_polling_stats(int fd, unsigned long device_index, int *polling, __u32 *event_rate, __u64 *mode_switches, __u64 *irq_events, __u64 *polled_events)
+{
+	int status;
+	poll_stats_t stats = {0};
+	status = ioctl(fd, apci_get_poll_stats, &stats);
+
+	if (polling != NULL) *polling = stats.mode;
+	if (event_rate != NULL) *event_rate = stats.event_rate;
+	if (mode_switches != NULL) *mode_switches = stats.mode_switches;
+	if (irq_events != NULL) *irq_events = stats.irq_events;
+	if (polled_events != NULL) *polled_events = stats.polled_events;
+
+	return status;
+}
+
+/* Wake after frames events or usecs after the first pending event, whichever comes first. */
+int apci_set_coalescing(int fd, unsigned long device_index, __u32 frames, __u32 usecs)
+{
+	coalesce_settings_t settings;
+	settings.frames = frames;
+	settings.usecs = usecs;
+	return ioctl(fd, apci_set_coalesce, &settings);
+}
+
+int apci_get_coalescing_stats(int fd, unsigned long device_index, coalesce_stats_t *stats)
+{
+	return ioctl(fd, apci_get_coalesce_stats, stats);
+}
+
+/* Have the driver restore the IRQ enables (mask, low byte first) after each
+ * event on cards whose ISR must disable the IRQ, instead of the user doing it.
+ */
+int apci_irq_rearm(int fd, unsigned long device_index, int enable, __u32 mask)
+{
+	rearm_settings_t settings;
+	settings.enable = enable;
+	settings.mask = mask;
+	return ioctl(fd, apci_set_rearm, &settings);
+}
+
+/* Filter CoS bounce in the driver: deliver one event per usecs window, and
+ * only if the inputs really changed. 0 turns the filter off.
+ */
+int apci_debounce(int fd, unsigned long device_index, unsigned long usecs)
+{
+	return ioctl(fd, apci_set_debounce, usecs);
+}
+
+int apci_debounce_stats(int fd, unsigned long device_index, debounce_stats_t *stats)
+{
+	return ioctl(fd, apci_get_debounce_stats, stats);
+}
+
+int apci_edge_counters(int fd, unsigned long device_index, edge_counters_t *counters)
+{
+	return ioctl(fd, apci_get_edge_counters, counters);
+}
+
+int apci_edge_counters_reset(int fd, unsigned long device_index)
+{
+	return ioctl(fd, apci_reset_edge_counters);
+}
+
+/* Map the driver's read-only edge counter page (PCIe-IDIO). Returns NULL on failure. */
+volatile edge_counters_t *apci_edge_counters_map(int fd)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, APCI_MMAP_EDGES * page_size);
+
+	return (page == MAP_FAILED) ? NULL : page;
+}
+
+/* Latch every quadrature channel and read the 64-bit positions. */
+int apci_quad_positions(int fd, unsigned long device_index, quad_state_t *state)
+{
+	return ioctl(fd, apci_quad_read, state);
+}
+
+/* Have the driver compute per-channel velocity hz times a second; 0 stops it. */
+int apci_quad_velocity(int fd, unsigned long device_index, unsigned long hz)
+{
+	return ioctl(fd, apci_quad_velocity_rate, hz);
+}
+
+/* Map the driver's read-only quadrature page. Returns NULL on failure. */
+volatile quad_state_t *apci_quad_map(int fd)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, APCI_MMAP_QUAD * page_size);
+
+	return (page == MAP_FAILED) ? NULL : page;
+}
+
+/* Let the driver keep a WDG card's /dev/watchdogN alive every ping_ms while
+ * apci_watchdog_heartbeat() has been called within heartbeat_ms. 0 stops it.
+ */
+int apci_watchdog_keepalive(int fd, unsigned long device_index, __u32 ping_ms, __u32 heartbeat_ms)
+{
+	wdt_keepalive_t keepalive = { .ping_ms = ping_ms, .heartbeat_ms = heartbeat_ms };
+
+	return ioctl(fd, apci_wdt_keepalive, &keepalive);
+}
+
+int apci_watchdog_heartbeat(int fd, unsigned long device_index)
+{
+	return ioctl(fd, apci_wdt_heartbeat_ioctl);
+}
+
+/* Have the driver drain words_per_irq FIFO samples into the DMA ring on
+ * every FIFO IRQ (PCI-AI12-16 family, LPCI-A16-16A); call after
+ * apci_dma_transfer_size. words_per_irq = 0 turns it off.
+ */
+int apci_fifo_drain(int fd, unsigned long device_index, __u32 words_per_irq)
+{
+	fifo_drain_t drain = { .enable = words_per_irq != 0, .words_per_irq = words_per_irq };
+
+	return ioctl(fd, apci_set_fifo_drain, &drain);
+}
+
+/* Size AxIO DMA slots and the FAF threshold for latency_us (0 = whole
+ * slots). sample_hz 0 follows the card's divisor, retuning when it is
+ * written. The achieved figures come back in lat, if given.
+ */
+int apci_dma_latency(int fd, unsigned long device_index, __u32 sample_hz, __u32 channels,
+                     __u32 latency_us, dma_latency_t *lat)
+{
+	dma_latency_t req = { .sample_hz = sample_hz, .channels = channels, .latency_us = latency_us };
+	int status = ioctl(fd, apci_set_dma_latency, &req);
+
+	if (status == 0 && lat) *lat = req;
+	return status;
+}
+
+/* Current AxIO latency sizing, including any retune after a divisor change. */
+int apci_dma_latency_get(int fd, unsigned long device_index, dma_latency_t *lat)
+{
+	return ioctl(fd, apci_get_dma_latency, lat);
+}
+
+/* Only wake DMA waiters when channel crosses threshold (AxIO); enable = 0 restores per-slot wakeups. */
+int apci_level_trigger(int fd, unsigned long device_index, const level_trigger_t *level)
+{
+	return ioctl(fd, apci_set_level_trigger, level);
+}
+
+int apci_level_crossing(int fd, unsigned long device_index, level_crossing_t *crossing)
+{
+	return ioctl(fd, apci_get_level_crossing, crossing);
+}
+
+/* Install (or with rule->enable = 0 remove) an event-to-action rule. */
+int apci_action_set(int fd, unsigned long device_index, const action_rule_t *rule)
+{
+	return ioctl(fd, apci_set_action, rule);
+}
+
+/* Map the driver's read-only action log; needs a rule set first. Returns NULL on failure. */
+volatile action_log_t *apci_action_log_map(int fd)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, APCI_MMAP_ACTIONS * page_size);
+
+	return (page == MAP_FAILED) ? NULL : page;
+}
+
+/* Choose cached (APCI_DMA_NONCOHERENT) or coherent memory for the rings
+ * allocated by later apci_dma_transfer_size calls.
+ */
+int apci_dma_ring_mode(int fd, unsigned long device_index, unsigned long mode)
+{
+	return ioctl(fd, apci_set_dma_ring_mode, mode);
+}
+
+/* APCI_RING_DROP_NEWEST (default) or APCI_RING_OVERWRITE_OLDEST when the ring is full. */
+int apci_dma_ring_policy(int fd, unsigned long device_index, unsigned long policy)
+{
+	return ioctl(fd, apci_set_dma_ring_policy, policy);
+}
+
+/* Give this fd its own DMA cursor: APCI_CURSOR_LOSSLESS holds the ring
+ * back until this fd has released its slots, APCI_CURSOR_LOSSY may skip.
+ * APCI_CURSOR_SHARED goes back to the single shared cursor.
+ */
+int apci_dma_cursor(int fd, unsigned long device_index, unsigned long mode)
+{
+	return ioctl(fd, apci_set_dma_cursor, mode);
+}
+
+/* Publish the samples still short of a full slot as a partial slot,
+ * e.g. after stopping acquisition. Kernel FIFO drain mode only.
+ */
+int apci_dma_flush(int fd, unsigned long device_index)
+{
+	return ioctl(fd, apci_flush_dma_ring);
+}
+
+/* Flush automatically when no slot completed for timeout_ms (0 = off). */
+int apci_dma_flush_timeout(int fd, unsigned long device_index, unsigned long timeout_ms)
+{
+	return ioctl(fd, apci_set_dma_flush_timeout, timeout_ms);
+}
+
+/* Export the DMA ring (APCI_DMABUF_RING) or DAC buffer (APCI_DMABUF_DAC)
+ * as a dma-buf. Returns a new fd to mmap or pass to another process, or
+ * -1 with errno set.
+ */
+int apci_dmabuf_fd(int fd, unsigned long device_index, unsigned long which)
+{
+	return ioctl(fd, apci_export_dmabuf, which);
+}
+
+/* Empty the DMA ring for a new run without reallocating it. */
+int apci_dma_reset(int fd, unsigned long device_index)
+{
+	return ioctl(fd, apci_reset_dma_ring);
+}
+
+/* DMA straight into buf (num_slots * slot_size bytes, each slot physically
+ * contiguous, e.g. in hugepages) instead of a driver-allocated ring.
+ * buf = NULL releases it.
+ */
+int apci_dma_user_buffer(int fd, unsigned long device_index, void *buf, __u32 num_slots, __u32 slot_size)
+{
+	dma_user_buffer_t buffer = { .addr = (__u64)(uintptr_t)buf, .num_slots = num_slots, .slot_size = slot_size };
+
+	return ioctl(fd, apci_set_dma_user_buffer, &buffer);
+}
+
+/* Map the num_slots metadata entries that go with the current DMA ring. Returns NULL on failure. */
+volatile slot_meta_t *apci_slot_meta_map(int fd, int num_slots)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *meta = mmap(NULL, num_slots * sizeof(slot_meta_t), PROT_READ, MAP_SHARED, fd, APCI_MMAP_SLOT_META * page_size);
+
+	return (meta == MAP_FAILED) ? NULL : meta;
+}
+
+/* Map the DMA ring's producer/consumer indices. Returns NULL on failure. */
+volatile dma_ring_ctl_t *apci_ring_map(int fd)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *page = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, APCI_MMAP_RING * page_size);
+
+	return (page == MAP_FAILED) ? NULL : page;
+}
+
+/* Map the driver's read-only status page. Returns NULL on failure. */
+volatile status_page_t *apci_status_map(int fd)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, APCI_MMAP_STATUS * page_size);
+
+	return (page == MAP_FAILED) ? NULL : page;
+}
+
+void apci_status_unmap(volatile status_page_t *page)
+{
+	munmap((void *)page, sysconf(_SC_PAGESIZE));
+}
+
+/* Copy a consistent snapshot of the status page, retrying while the ISR is mid-update. */
+void apci_status_read(volatile status_page_t *page, status_page_t *snapshot)
+{
+	__u32 seq;
+
+	do
+	{
+		seq = page->seq;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		snapshot->seq = seq;
+		snapshot->last_status = page->last_status;
+		snapshot->event_count = page->event_count;
+		snapshot->last_event_ns = page->last_event_ns;
+		snapshot->dma_last_buffer = page->dma_last_buffer;
+		snapshot->dma_first_valid = page->dma_first_valid;
+		snapshot->dma_data_discarded = page->dma_data_discarded;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || (seq != page->seq));
+}
+
+/* Spin, without syscalls, until event_count moves past last_event_count.
+ * timeout_ns == 0 spins forever. Returns 0 with *snapshot filled in, or
+ * -ETIMEDOUT. Intended for a thread pinned to its own core. Only the
+ * 32-bit seq is polled; event_count (64 bits, so it may tear on 32-bit
+ * machines) is read through apci_status_read once seq moves.
+ */
+int apci_status_spin_wait(volatile status_page_t *page, __u64 last_event_count, status_page_t *snapshot, __u64 timeout_ns)
+{
+	struct timespec now;
+	__u64 deadline = 0;
+	unsigned int spins = 0;
+
+	if (timeout_ns)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		deadline = now.tv_sec * 1000000000ULL + now.tv_nsec + timeout_ns;
+	}
+
+	apci_status_read(page, snapshot);
+	while (snapshot->event_count == last_event_count)
+	{
+		while (page->seq == snapshot->seq)
+		{
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#endif
+			if (deadline && (++spins % 1024) == 0)
+			{
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if (now.tv_sec * 1000000000ULL + now.tv_nsec >= deadline)
+					return -ETIMEDOUT;
+			}
+		}
+		apci_status_read(page, snapshot);
+	}
+	return 0;
+}
+
+/* Steer the card's IRQ to cpu; cpu < 0 removes the hint. */
+int apci_irq_affinity(int fd, unsigned long device_index, int cpu)
+{
+	return ioctl(fd, apci_set_irq_affinity, (long)cpu);
+}
+
+int apci_irq_info(int fd, unsigned long device_index, int *irq, int *numa_node, int *affinity_cpu)
+{
+	int status;
+	irq_info_t info = {-1, -1, -1};
+	status = ioctl(fd, apci_get_irq_info, &info);
+
+	if (irq != NULL) *irq = info.irq;
+	if (numa_node != NULL) *numa_node = info.numa_node;
+	if (affinity_cpu != NULL) *affinity_cpu = info.affinity_cpu;
+
+	return status;
+}
+
+/* Pin the calling thread next to the card's IRQ: onto the CPU the IRQ is
+ * steered to if there is one, otherwise onto the CPUs of the card's NUMA node.
+ */
+int apci_pin_to_irq(int fd, unsigned long device_index)
+{
+	int status;
+	int numa_node, affinity_cpu;
+	cpu_set_t set;
+
+	status = apci_irq_info(fd, device_index, NULL, &numa_node, &affinity_cpu);
+	if (status) return status;
+
+	CPU_ZERO(&set);
+	if (affinity_cpu >= 0)
+	{
+		CPU_SET(affinity_cpu, &set);
+	}
+	else if (numa_node >= 0)
+	{
+		char path[64];
+		FILE *cpulist;
+		int first, last;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", numa_node);
+		cpulist = fopen(path, "r");
+		if (cpulist == NULL) return -ENOENT;
+
+		while (fscanf(cpulist, "%d", &first) == 1)
+		{
+			last = first;
+			if (fscanf(cpulist, "-%d", &last) < 0) last = first;
+			for (; first <= last; first++) CPU_SET(first, &set);
+			if (fgetc(cpulist) != ',') break;
+		}
+		fclose(cpulist);
+	}
+	else
+	{
+		return -ENODEV;
+	}
+
+	return sched_setaffinity(0, sizeof(set), &set);
+}
@@ -21,8 +21,11 @@ For more information please contact the ACCES software department at
 (800)-326-1649 or visit www.accesio.com
 */
 
+#include <stddef.h>
 #include <linux/types.h>
 
+#include "apci_ioctl.h"
+
 int apci_get_devices(int fd);
 
 int apci_get_device_info(int fd, unsigned long device_index, unsigned int *dev_id, unsigned long base_addresses[6]);
@@ -38,12 +41,90 @@ int apci_read32(int fd, unsigned long device_index, int bar, int offset, __u32 *
 int apci_wait_for_irq(int fd, unsigned long device_index);
 int apci_cancel_irq(int fd, unsigned long device_index);
 
-int apci_dma_transfer_size(int fd, unsigned long device_index, __u8 num_slots, size_t slot_size);
+int apci_dma_transfer_size(int fd, unsigned long device_index, int num_slots, size_t slot_size);
+int apci_dma_reset(int fd, unsigned long device_index);
+int apci_dma_ring_mode(int fd, unsigned long device_index, unsigned long mode);
+int apci_dma_ring_policy(int fd, unsigned long device_index, unsigned long policy);
+int apci_dma_cursor(int fd, unsigned long device_index, unsigned long mode);
+int apci_dma_flush(int fd, unsigned long device_index);
+int apci_dmabuf_fd(int fd, unsigned long device_index, unsigned long which);
+int apci_dma_flush_timeout(int fd, unsigned long device_index, unsigned long timeout_ms);
 int apci_dma_data_ready(int fd, unsigned long device_index, int *start_index, int *slots, int *data_discarded);
 int apci_dma_data_done(int fd, unsigned long device_index, int num_slots);
+int apci_dma_wait_for_data(int fd, unsigned long device_index, int min_slots, unsigned int timeout_ms, int release_slots, int *start_index, int *slots, int *data_discarded);
 
 int apci_writebuf8(int fd, unsigned long device_index, int bar, int bar_offset, unsigned int mmap_offset, int length);
 int apci_writebuf16(int fd, unsigned long device_index, int bar, int bar_offset, unsigned int mmap_offset, int length);
 int apci_writebuf32(int fd, unsigned long device_index, int bar, int bar_offset, unsigned int mmap_offset, int length);
 
 int apci_dac_buffer_size (int fd, unsigned long size);
+
+int apci_set_polling(int fd, unsigned long device_index, __u32 enter_rate, __u32 exit_rate, __u32 interval_us);
+int apci_get_polling_stats(int fd, unsigned long device_index, int *polling, __u32 *event_rate, __u64 *mode_switches, __u64 *irq_events, __u64 *polled_events);
+
+volatile status_page_t *apci_status_map(int fd);
+void apci_status_unmap(volatile status_page_t *page);
+void apci_status_read(volatile status_page_t *page, status_page_t *snapshot);
+int apci_status_spin_wait(volatile status_page_t *page, __u64 last_event_count, status_page_t *snapshot, __u64 timeout_ns);
+
+int apci_dma_user_buffer(int fd, unsigned long device_index, void *buf, __u32 num_slots, __u32 slot_size);
+volatile dma_ring_ctl_t *apci_ring_map(int fd);
+volatile slot_meta_t *apci_slot_meta_map(int fd, int num_slots);
+
+/* Syscall-free DMA consumption through the mapped ring indices: returns
+ * the number of ready slots and the first one's index in *slot. Slots the
+ * driver overwrote (ring->oldest ahead of consumer) are skipped. Indices
+ * count modulo ring->index_wrap.
+ */
+static inline __u32 apci_ring_peek(volatile dma_ring_ctl_t *ring, __u32 *slot)
+{
+	__u32 producer = __atomic_load_n(&ring->producer, __ATOMIC_ACQUIRE);
+	__u32 wrap = ring->index_wrap;
+	__u32 consumer = ring->consumer;
+	__u32 oldest = __atomic_load_n(&ring->oldest, __ATOMIC_RELAXED);
+	__u32 behind = (oldest + wrap - consumer) % wrap;
+
+	if (behind && behind < wrap / 2)
+	{
+		consumer = oldest;
+		__atomic_store_n(&ring->consumer, consumer, __ATOMIC_RELEASE);
+	}
+
+	*slot = consumer % ring->num_slots;
+	return (producer + wrap - consumer) % wrap;
+}
+
+/* Hand count slots returned by apci_ring_peek() back to the driver. */
+static inline void apci_ring_release(volatile dma_ring_ctl_t *ring, __u32 count)
+{
+	__atomic_store_n(&ring->consumer, (ring->consumer + count) % ring->index_wrap, __ATOMIC_RELEASE);
+}
+
+int apci_set_coalescing(int fd, unsigned long device_index, __u32 frames, __u32 usecs);
+int apci_get_coalescing_stats(int fd, unsigned long device_index, coalesce_stats_t *stats);
+
+int apci_irq_rearm(int fd, unsigned long device_index, int enable, __u32 mask);
+
+int apci_debounce(int fd, unsigned long device_index, unsigned long usecs);
+int apci_debounce_stats(int fd, unsigned long device_index, debounce_stats_t *stats);
+
+int apci_edge_counters(int fd, unsigned long device_index, edge_counters_t *counters);
+int apci_edge_counters_reset(int fd, unsigned long device_index);
+volatile edge_counters_t *apci_edge_counters_map(int fd);
+int apci_quad_positions(int fd, unsigned long device_index, quad_state_t *state);
+int apci_quad_velocity(int fd, unsigned long device_index, unsigned long hz);
+volatile quad_state_t *apci_quad_map(int fd);
+int apci_watchdog_keepalive(int fd, unsigned long device_index, __u32 ping_ms, __u32 heartbeat_ms);
+int apci_watchdog_heartbeat(int fd, unsigned long device_index);
+int apci_fifo_drain(int fd, unsigned long device_index, __u32 words_per_irq);
+int apci_dma_latency(int fd, unsigned long device_index, __u32 sample_hz, __u32 channels,
+                     __u32 latency_us, dma_latency_t *lat);
+int apci_dma_latency_get(int fd, unsigned long device_index, dma_latency_t *lat);
+int apci_level_trigger(int fd, unsigned long device_index, const level_trigger_t *level);
+int apci_level_crossing(int fd, unsigned long device_index, level_crossing_t *crossing);
+int apci_action_set(int fd, unsigned long device_index, const action_rule_t *rule);
+volatile action_log_t *apci_action_log_map(int fd);
+
+int apci_irq_affinity(int fd, unsigned long device_index, int cpu);
+int apci_irq_info(int fd, unsigned long device_index, int *irq, int *numa_node, int *affinity_cpu);
+int apci_pin_to_irq(int fd, unsigned long device_index);
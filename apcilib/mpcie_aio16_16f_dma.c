@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -188,27 +189,29 @@ void * worker_main(void *arg)
 	int data_discarded;
 	int buffers_queued;
 
+	int slots_to_release = 0;
+
 	do
 	{
-		if (0) printf("  Worker Thread: About to call apci_dma_data_ready()\n");
+		if (0) printf("  Worker Thread: About to call apci_dma_wait_for_data()\n");
 		fflush(stdout);
-		status = apci_dma_data_ready(fd, 1, &first_slot, &num_slots, &data_discarded);      
+		status = apci_dma_wait_for_data(fd, 1, 1, 1000, slots_to_release, &first_slot, &num_slots, &data_discarded);
+		slots_to_release = 0;
 
 		if (data_discarded != 0)
 		{
 			printf("  Worker Thread: first_slot = %d, num_slots = %d, data_discarded = %d\n", first_slot, num_slots, data_discarded);
 		}
 
-		if (num_slots == 0)
+		if (status)
 		{
-			if (0) printf("  Worker Thread: No data pending; Waiting for IRQ\n");
-			status = apci_wait_for_irq(fd, 1);  // thread blocking
-			if (status)
+			if (errno == ETIMEDOUT)
 			{
-				printf("  Worker Thread: Error waiting for IRQ\n");
-				break;
+				if (0) printf("  Worker Thread: No data pending\n");
+				continue;
 			}
-			continue;
+			printf("  Worker Thread: Error waiting for data\n");
+			break;
 		}
 
 		if (0) printf("  Worker Thread: data [%d slots] in slot %d\n", num_slots, first_slot);
@@ -234,8 +237,8 @@ void * worker_main(void *arg)
 
 		__sync_synchronize();
 
-		if (0) printf("  Worker Thread: Telling driver we've taken %d buffer%c\n", num_slots, (num_slots == 1) ? ' ':'s');
-		apci_dma_data_done(fd, 1, num_slots);
+		if (0) printf("  Worker Thread: Releasing %d buffer%c on the next wait\n", num_slots, (num_slots == 1) ? ' ':'s');
+		slots_to_release = num_slots;
 
 		for (int i = 0; i < num_slots; i++)
 		{